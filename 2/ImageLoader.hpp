@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <vector>
+
+struct LoadedImage
+{
+    cv::Mat colour;
+    cv::Mat grey;
+    size_t bytesRead = 0;
+    double readMs = 0;
+    double decodeMs = 0;
+    double greyMs = 0;
+};
+
+// Reads the file once, decodes it once and derives grey from the decoded colour buffer with the
+// SIMD cvtColor path, instead of decoding the file a second time with IMREAD_GRAYSCALE. A scale of
+// 2, 4 or 8 asks the codec for a reduced-resolution decode (JPEG decodes straight to the smaller
+// size, which is far cheaper than decoding and resizing).
+inline bool loadImage(const std::filesystem::path &path, LoadedImage &image, int scale = 1)
+{
+    TRACE_SCOPE("loadImage");
+    using Clock = std::chrono::steady_clock;
+
+    int flags = cv::IMREAD_COLOR;
+    switch (scale)
+    {
+        case 1:
+            break;
+        case 2:
+            flags = cv::IMREAD_REDUCED_COLOR_2;
+            break;
+        case 4:
+            flags = cv::IMREAD_REDUCED_COLOR_4;
+            break;
+        case 8:
+            flags = cv::IMREAD_REDUCED_COLOR_8;
+            break;
+        default:
+            CV_Error(cv::Error::StsBadArg, "Decode scale must be 1, 2, 4 or 8");
+    }
+
+    const auto start = Clock::now();
+
+    std::ifstream file{path, std::ios::binary | std::ios::ate};
+    if (!file)
+        return false;
+
+    // imdecode asserts on an empty buffer, so a zero-length file is rejected here.
+    std::vector<uchar> buffer(static_cast<size_t>(file.tellg()));
+    if (buffer.empty())
+        return false;
+
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(buffer.data()), static_cast<std::streamsize>(buffer.size())))
+        return false;
+
+    const auto read = Clock::now();
+    image.colour = cv::imdecode(buffer, flags);
+    const auto decoded = Clock::now();
+
+    if (image.colour.empty())
+        return false;
+
+    cv::cvtColor(image.colour, image.grey, cv::COLOR_BGR2GRAY);
+    const auto converted = Clock::now();
+
+    image.bytesRead = buffer.size();
+    image.readMs = std::chrono::duration<double, std::milli>(read - start).count();
+    image.decodeMs = std::chrono::duration<double, std::milli>(decoded - read).count();
+    image.greyMs = std::chrono::duration<double, std::milli>(converted - decoded).count();
+
+    return true;
+}
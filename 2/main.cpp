@@ -1,19 +1,38 @@
+#include "ImageLoader.hpp"
 #include <iostream>
 #include <format>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 
-int main() {
-    auto filename = cv::samples::findFile("lena.jpg");
-    auto colour = cv::imread(filename);
-    auto gray = cv::imread(filename, cv::IMREAD_GRAYSCALE);
+int main(int argc, char **argv) {
+    const char *keys = {
+            "{help h usage? || print  this message}"
+            "{@image | lena.jpg | Image to load, looked up in the OpenCV samples}"
+            "{scale | 1 | Reduced-resolution decode: 1, 2, 4 or 8}"};
 
-    if (!colour.data)
+    cv::CommandLineParser parser{argc, argv, keys};
+
+    if (parser.has("help"))
+    {
+        parser.printMessage();
+        return 0;
+    }
+
+    auto filename = cv::samples::findFile(parser.get<cv::String>(0));
+    LoadedImage image;
+
+    if (!loadImage(filename, image, parser.get<int>("scale")))
     {
         std::cerr << "Could not open or find the image\n";
         return 1;
     }
 
+    auto &colour = image.colour;
+    auto &gray = image.grey;
+
+    std::cout << std::format("Read {} bytes in {:.2f} ms, decoded {}x{} in {:.2f} ms, gray in {:.2f} ms\n",
+                             image.bytesRead, image.readMs, colour.cols, colour.rows, image.decodeMs, image.greyMs);
+
     cv::imwrite("lenagray.jpg", gray);
     auto col = colour.cols - 1;
     auto row = colour.rows - 1;
@@ -26,5 +45,7 @@ int main() {
 
     cv::waitKey(0);
 
+    TRACE_DUMP("lab2.trace.json");
+
     return 0;
 }
@@ -0,0 +1,204 @@
+#pragma once
+
+#include "ChangeDetector.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <opencv2/videoio.hpp>
+#include <thread>
+#include <vector>
+
+enum class OverflowPolicy
+{
+    DropOldest,
+    Block
+};
+
+struct Frame
+{
+    cv::Mat image;
+    uint64_t index = 0;
+    std::chrono::steady_clock::time_point captured;
+    // Barely differs from the last frame that was processed; still passed along so the consumer keeps
+    // its pace, but not filtered or shown.
+    bool unchanged = false;
+};
+
+struct CaptureStats
+{
+    uint64_t decoded = 0;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    uint64_t displayed = 0;
+    size_t queueDepth = 0;
+    size_t maxQueueDepth = 0;
+    double decodeMsTotal = 0;
+    double decodeMsMax = 0;
+    double latencyMsTotal = 0;
+    double latencyMsMax = 0;
+
+    void print(std::ostream &out) const
+    {
+        out << "decoded " << decoded << ", delivered " << delivered << ", dropped " << dropped
+            << ", queue depth " << queueDepth << " (max " << maxQueueDepth << ")\n"
+            << "decode ms avg " << (decoded ? decodeMsTotal / static_cast<double>(decoded) : 0) << " max " << decodeMsMax << '\n'
+            << "latency ms avg " << (displayed ? latencyMsTotal / static_cast<double>(displayed) : 0) << " max " << latencyMsMax << '\n';
+    }
+};
+
+// Decodes on a dedicated thread into a bounded ring of preallocated frames. Buffers are never freed
+// while running: the producer swaps its freshly decoded frame into the ring and the consumer swaps
+// its previous frame back in exchange for the oldest queued one.
+class CaptureQueue
+{
+    using Clock = std::chrono::steady_clock;
+
+    cv::VideoCapture &capture;
+    OverflowPolicy policy;
+    ChangeDetector *detector;
+    std::vector<Frame> slots;
+    size_t head = 0;
+    size_t size = 0;
+    bool finished = false;
+    CaptureStats stats;
+
+    mutable std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable_any notFull;
+    std::jthread worker;
+
+    void decodeLoop(const std::stop_token &stopToken)
+    {
+        Frame spare;
+        spare.image = slots.front().image.clone();
+
+        for (uint64_t index = 0; !stopToken.stop_requested(); ++index)
+        {
+            const auto start = Clock::now();
+            {
+                TRACE_SCOPE("capture.read");
+                if (!capture.read(spare.image) || spare.image.empty())
+                    break;
+            }
+
+            const auto decoded = Clock::now();
+            const auto decodeMs = std::chrono::duration<double, std::milli>(decoded - start).count();
+            spare.index = index;
+            spare.captured = decoded;
+
+            std::unique_lock lock{mutex};
+            stats.decoded++;
+            stats.decodeMsTotal += decodeMs;
+            stats.decodeMsMax = std::max(stats.decodeMsMax, decodeMs);
+
+            if (size == slots.size())
+            {
+                if (policy == OverflowPolicy::Block)
+                {
+                    if (!notFull.wait(lock, stopToken, [&]() { return size < slots.size(); }))
+                        break;
+                }
+                else
+                {
+                    head = (head + 1) % slots.size();
+                    size--;
+                    stats.dropped++;
+                }
+            }
+
+            std::swap(slots[(head + size) % slots.size()], spare);
+            size++;
+            stats.maxQueueDepth = std::max(stats.maxQueueDepth, size);
+            notEmpty.notify_one();
+        }
+
+        std::lock_guard lock{mutex};
+        finished = true;
+        notEmpty.notify_all();
+    }
+
+public:
+    // changeDetector, when given, flags unchanged frames as pop() hands them out. Frames the ring drops
+    // never reach it, so its reference only ever advances to frames the consumer receives.
+    CaptureQueue(cv::VideoCapture &videoCapture, size_t capacity, OverflowPolicy overflowPolicy, ChangeDetector *changeDetector = nullptr) : capture(videoCapture), policy(overflowPolicy), detector(changeDetector), slots(std::max<size_t>(capacity, 1))
+    {
+        const auto width = static_cast<int>(capture.get(cv::CAP_PROP_FRAME_WIDTH));
+        const auto height = static_cast<int>(capture.get(cv::CAP_PROP_FRAME_HEIGHT));
+
+        if (width > 0 && height > 0)
+            for (auto &slot: slots)
+                slot.image.create(height, width, CV_8UC3);
+    }
+
+    ~CaptureQueue()
+    {
+        stop();
+    }
+
+    CaptureQueue(CaptureQueue &&queue) = delete;
+    CaptureQueue &operator=(CaptureQueue &&queue) = delete;
+    CaptureQueue(CaptureQueue const &queue) = delete;
+    CaptureQueue &operator=(CaptureQueue const &queue) = delete;
+
+    void start()
+    {
+        worker = std::jthread{[this](const std::stop_token &stopToken) { decodeLoop(stopToken); }};
+    }
+
+    void stop()
+    {
+        if (!worker.joinable())
+            return;
+
+        worker.request_stop();
+        worker.join();
+    }
+
+    // Blocks until a frame is available. The caller's previous frame buffer is recycled into the ring.
+    // Returns false once the stream has ended and every queued frame was consumed.
+    bool pop(Frame &frame)
+    {
+        TRACE_SCOPE("CaptureQueue::pop");
+        {
+            std::unique_lock lock{mutex};
+            notEmpty.wait(lock, [&]() { return size > 0 || finished; });
+
+            if (!size)
+                return false;
+
+            std::swap(frame, slots[head]);
+            head = (head + 1) % slots.size();
+            size--;
+            stats.delivered++;
+            notFull.notify_one();
+        }
+
+        frame.unchanged = detector && !detector->detect(frame.image);
+
+        return true;
+    }
+
+    // Records capture-to-display latency once the consumer has presented the frame.
+    void markDisplayed(const Frame &frame)
+    {
+        const auto latencyMs = std::chrono::duration<double, std::milli>(Clock::now() - frame.captured).count();
+
+        std::lock_guard lock{mutex};
+        stats.displayed++;
+        stats.latencyMsTotal += latencyMs;
+        stats.latencyMsMax = std::max(stats.latencyMsMax, latencyMs);
+    }
+
+    [[nodiscard]] CaptureStats getStats() const
+    {
+        std::lock_guard lock{mutex};
+        auto snapshot = stats;
+        snapshot.queueDepth = size;
+
+        return snapshot;
+    }
+};
@@ -0,0 +1,348 @@
+#pragma once
+
+#include "CaptureQueue.hpp"
+#include "LiveHistogram.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <opencv2/imgproc.hpp>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PipelineStage
+{
+    std::string name;
+    std::function<void(const cv::Mat &in, cv::Mat &out)> apply;
+};
+
+// Parses a comma separated chain such as "blur,grey,sobel" into stages that run in the given order,
+// with the filters of lab 5, plus "equalize" and "histogram" for live exposure equalisation and a
+// histogram overlay; those keep state across frames. Returns false on an unknown stage name.
+inline bool parseStages(const std::string &spec, std::vector<PipelineStage> &stages)
+{
+    std::stringstream stream{spec};
+    std::string stage;
+
+    while (std::getline(stream, stage, ','))
+    {
+        std::transform(stage.begin(), stage.end(), stage.begin(), [](unsigned char c) { return std::tolower(c); });
+
+        if (stage == "blur")
+            stages.push_back({stage, [](const cv::Mat &in, cv::Mat &out) { cv::blur(in, out, cv::Size(5, 5)); }});
+        else if (stage == "grey" || stage == "gray")
+            stages.push_back({"grey", [](const cv::Mat &in, cv::Mat &out)
+                              {
+                                  if (in.channels() == 3)
+                                      cv::cvtColor(in, out, cv::COLOR_BGR2GRAY);
+                                  else
+                                      in.copyTo(out);
+                              }});
+        else if (stage == "sobel")
+            stages.push_back({stage, [](const cv::Mat &in, cv::Mat &out) { cv::Sobel(in, out, CV_8U, 1, 1); }});
+        else if (stage == "equalize")
+            stages.push_back({stage, [equalizer = std::make_shared<TemporalEqualizer>()](const cv::Mat &in, cv::Mat &out) { equalizer->apply(in, out); }});
+        else if (stage == "histogram")
+            stages.push_back({stage, [overlay = std::make_shared<HistogramOverlay>()](const cv::Mat &in, cv::Mat &out) { overlay->apply(in, out); }});
+        else if (!stage.empty())
+            return false;
+    }
+
+    return !stages.empty();
+}
+
+// Bounded FIFO between two pipeline threads. Like the CaptureQueue ring, frames are swapped in and
+// out so the image buffers circulate between producer, slots and consumer instead of being reallocated.
+class FrameChannel
+{
+    std::vector<Frame> slots;
+    size_t head = 0;
+    size_t size = 0;
+    bool closed = false;
+
+    std::mutex mutex;
+    std::condition_variable_any notEmpty;
+    std::condition_variable_any notFull;
+
+public:
+    explicit FrameChannel(size_t capacity) : slots(std::max<size_t>(capacity, 1))
+    {
+    }
+
+    FrameChannel(FrameChannel &&channel) = delete;
+    FrameChannel &operator=(FrameChannel &&channel) = delete;
+    FrameChannel(FrameChannel const &channel) = delete;
+    FrameChannel &operator=(FrameChannel const &channel) = delete;
+
+    // Blocks while the channel is full. frame comes back holding a recycled buffer.
+    bool push(Frame &frame, const std::stop_token &stopToken)
+    {
+        std::unique_lock lock{mutex};
+        if (!notFull.wait(lock, stopToken, [&]() { return size < slots.size(); }))
+            return false;
+
+        std::swap(slots[(head + size) % slots.size()], frame);
+        size++;
+        notEmpty.notify_one();
+
+        return true;
+    }
+
+    // Blocks while the channel is empty. Returns false once it is closed and drained, or on stop.
+    bool pop(Frame &frame, const std::stop_token &stopToken = {})
+    {
+        std::unique_lock lock{mutex};
+        if (!notEmpty.wait(lock, stopToken, [&]() { return size > 0 || closed; }) || !size)
+            return false;
+
+        std::swap(frame, slots[head]);
+        head = (head + 1) % slots.size();
+        size--;
+        notFull.notify_one();
+
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard lock{mutex};
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+    [[nodiscard]] size_t depth()
+    {
+        std::lock_guard lock{mutex};
+
+        return size;
+    }
+};
+
+struct StageStats
+{
+    std::string name;
+    uint64_t frames = 0;
+    double busyMs = 0;
+    double starvedMs = 0;
+    double blockedMs = 0;
+};
+
+struct PipelineStats
+{
+    std::vector<StageStats> stages;
+    uint64_t displayed = 0;
+    uint64_t outOfOrder = 0;
+    double elapsedMs = 0;
+    double latencyMsTotal = 0;
+    double latencyMsMax = 0;
+
+    [[nodiscard]] double fps() const
+    {
+        return elapsedMs > 0 ? static_cast<double>(displayed) * 1000. / elapsedMs : 0;
+    }
+
+    // Share of the run a stage spent working. The busiest stage caps the throughput of the pipeline.
+    void print(std::ostream &out) const
+    {
+        out << "pipeline: " << displayed << " frames in " << elapsedMs / 1000. << " s, " << fps() << " fps sustained, "
+            << outOfOrder << " out of order, latency ms avg " << (displayed ? latencyMsTotal / static_cast<double>(displayed) : 0)
+            << " max " << latencyMsMax << '\n';
+        out << std::left << std::setw(10) << "stage" << std::right << std::setw(8) << "frames" << std::setw(12) << "ms/frame"
+            << std::setw(8) << "busy" << std::setw(10) << "starved" << std::setw(10) << "blocked" << '\n';
+
+        const StageStats *bottleneck = nullptr;
+        for (const auto &stage: stages)
+        {
+            const auto share = [&](double ms) { return elapsedMs > 0 ? 100. * ms / elapsedMs : 0; };
+            out << std::left << std::setw(10) << stage.name << std::right << std::setw(8) << stage.frames
+                << std::setw(12) << std::fixed << std::setprecision(2) << (stage.frames ? stage.busyMs / static_cast<double>(stage.frames) : 0)
+                << std::setw(7) << std::setprecision(1) << share(stage.busyMs) << '%'
+                << std::setw(9) << share(stage.starvedMs) << '%' << std::setw(9) << share(stage.blockedMs) << '%' << '\n'
+                << std::defaultfloat << std::setprecision(6);
+
+            if (!bottleneck || stage.busyMs > bottleneck->busyMs)
+                bottleneck = &stage;
+        }
+
+        if (bottleneck)
+            out << "bottleneck: " << bottleneck->name << '\n';
+    }
+};
+
+// Runs filter stages on the frames of a CaptureQueue, one thread per stage, connected by bounded
+// FrameChannels. Every stage handles one frame at a time and the channels are FIFO, so frames leave
+// in capture order. The consumer (the display loop) pops from the last channel.
+class FramePipeline
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Timing
+    {
+        uint64_t frames = 0;
+        Clock::duration busy{};
+        Clock::duration starved{};
+        Clock::duration blocked{};
+    };
+
+    CaptureQueue &source;
+    std::vector<PipelineStage> stages;
+    std::vector<std::unique_ptr<FrameChannel>> channels;
+    std::vector<Timing> timings;
+    std::vector<std::jthread> workers;
+
+    mutable std::mutex mutex;
+    Clock::time_point started;
+    Clock::time_point stopped;
+    Clock::time_point popped;
+    Timing display;
+    uint64_t lastIndex = 0;
+    uint64_t outOfOrder = 0;
+    double latencyMsTotal = 0;
+    double latencyMsMax = 0;
+
+    void stageLoop(size_t stage, const std::stop_token &stopToken)
+    {
+        Frame input;
+        Frame output;
+        Timing timing;
+        auto &channel = *channels[stage];
+
+        while (!stopToken.stop_requested())
+        {
+            const auto waiting = Clock::now();
+            if (!(stage ? channels[stage - 1]->pop(input, stopToken) : source.pop(input)))
+                break;
+
+            const auto start = Clock::now();
+            if (!input.unchanged)
+            {
+                TRACE_SCOPE("FramePipeline::stage");
+                stages[stage].apply(input.image, output.image);
+            }
+            output.index = input.index;
+            output.captured = input.captured;
+            output.unchanged = input.unchanged;
+
+            const auto done = Clock::now();
+            const auto pushed = channel.push(output, stopToken);
+
+            timing.frames++;
+            timing.starved += start - waiting;
+            timing.busy += done - start;
+            timing.blocked += Clock::now() - done;
+
+            {
+                std::lock_guard lock{mutex};
+                timings[stage] = timing;
+            }
+
+            if (!pushed)
+                break;
+        }
+
+        channel.close();
+    }
+
+public:
+    FramePipeline(CaptureQueue &captureQueue, std::vector<PipelineStage> pipelineStages, size_t capacity) : source(captureQueue), stages(std::move(pipelineStages)), timings(stages.size())
+    {
+        CV_Assert(!stages.empty());
+
+        for (size_t i = 0; i < stages.size(); ++i)
+            channels.push_back(std::make_unique<FrameChannel>(capacity));
+    }
+
+    ~FramePipeline()
+    {
+        stop();
+    }
+
+    FramePipeline(FramePipeline &&pipeline) = delete;
+    FramePipeline &operator=(FramePipeline &&pipeline) = delete;
+    FramePipeline(FramePipeline const &pipeline) = delete;
+    FramePipeline &operator=(FramePipeline const &pipeline) = delete;
+
+    // Starts the capture thread as well.
+    void start()
+    {
+        started = popped = Clock::now();
+        source.start();
+
+        for (size_t i = 0; i < stages.size(); ++i)
+            workers.emplace_back([this, i](const std::stop_token &stopToken) { stageLoop(i, stopToken); });
+    }
+
+    void stop()
+    {
+        if (workers.empty())
+            return;
+
+        source.stop();
+        for (auto &worker: workers)
+            worker.request_stop();
+        workers.clear();
+
+        std::lock_guard lock{mutex};
+        stopped = Clock::now();
+    }
+
+    // Blocks until the next filtered frame is available; the time until markDisplayed() is the
+    // display stage's work. Returns false once the stream has ended and drained.
+    bool pop(Frame &frame)
+    {
+        const auto waiting = Clock::now();
+        const auto available = channels.back()->pop(frame);
+
+        std::lock_guard lock{mutex};
+        popped = Clock::now();
+        display.starved += popped - waiting;
+
+        return available;
+    }
+
+    void markDisplayed(const Frame &frame)
+    {
+        const auto now = Clock::now();
+        const auto latencyMs = std::chrono::duration<double, std::milli>(now - frame.captured).count();
+
+        std::lock_guard lock{mutex};
+        if (display.frames && frame.index <= lastIndex)
+            outOfOrder++;
+        lastIndex = frame.index;
+
+        display.frames++;
+        display.busy += now - popped;
+        latencyMsTotal += latencyMs;
+        latencyMsMax = std::max(latencyMsMax, latencyMs);
+    }
+
+    [[nodiscard]] PipelineStats getStats() const
+    {
+        const auto capture = source.getStats();
+        const auto toMs = [](Clock::duration duration) { return std::chrono::duration<double, std::milli>(duration).count(); };
+
+        std::lock_guard lock{mutex};
+        PipelineStats stats;
+        const auto end = workers.empty() ? stopped : Clock::now();
+        stats.elapsedMs = toMs(end - started);
+        stats.displayed = display.frames;
+        stats.outOfOrder = outOfOrder;
+        stats.latencyMsTotal = latencyMsTotal;
+        stats.latencyMsMax = latencyMsMax;
+
+        stats.stages.push_back({"decode", capture.decoded, capture.decodeMsTotal, 0, 0});
+        for (size_t i = 0; i < stages.size(); ++i)
+            stats.stages.push_back({stages[i].name, timings[i].frames, toMs(timings[i].busy), toMs(timings[i].starved), toMs(timings[i].blocked)});
+        stats.stages.push_back({"display", display.frames, toMs(display.busy), toMs(display.starved), 0});
+
+        return stats;
+    }
+};
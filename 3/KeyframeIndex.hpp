@@ -0,0 +1,161 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <opencv2/videoio.hpp>
+#include <string>
+#include <system_error>
+#include <vector>
+
+struct Keyframe
+{
+    int64_t frame = 0;
+    double ms = 0;
+};
+
+// Keyframe positions of a video file. build() finds them in one pass over the packets of the stream,
+// which are demuxed but never decoded, so indexing costs about as much as reading the file. The index
+// is kept next to the video as "<video>.keyframes" and reused as long as the size and modification
+// time of the video still match the ones recorded in it.
+class KeyframeIndex
+{
+    static constexpr const char *magic = "opencvlabs-keyframes";
+    static constexpr int version = 1;
+
+    std::vector<Keyframe> keyframes;
+    int64_t frameCount = 0;
+    double fps = 0;
+
+    static bool stamp(const std::filesystem::path &video, uintmax_t &size, int64_t &modified)
+    {
+        std::error_code error;
+        size = std::filesystem::file_size(video, error);
+        if (error)
+            return false;
+
+        modified = std::filesystem::last_write_time(video, error).time_since_epoch().count();
+        return !error;
+    }
+
+public:
+    [[nodiscard]] static std::filesystem::path sidecarPath(const std::filesystem::path &video)
+    {
+        auto path = video;
+        path += ".keyframes";
+
+        return path;
+    }
+
+    bool load(const std::filesystem::path &video)
+    {
+        uintmax_t size = 0;
+        int64_t modified = 0;
+        if (!stamp(video, size, modified))
+            return false;
+
+        std::ifstream in{sidecarPath(video)};
+        std::string fileMagic;
+        int fileVersion = 0;
+        uintmax_t fileSize = 0;
+        int64_t fileModified = 0;
+        size_t count = 0;
+
+        if (!(in >> fileMagic >> fileVersion >> fileSize >> fileModified >> frameCount >> fps >> count) || fileMagic != magic ||
+            fileVersion != version || fileSize != size || fileModified != modified)
+            return false;
+
+        keyframes.resize(count);
+        for (auto &keyframe: keyframes)
+        {
+            if (!(in >> keyframe.frame >> keyframe.ms))
+            {
+                keyframes.clear();
+                return false;
+            }
+        }
+
+        return !keyframes.empty();
+    }
+
+    bool save(const std::filesystem::path &video) const
+    {
+        uintmax_t size = 0;
+        int64_t modified = 0;
+        if (!stamp(video, size, modified))
+            return false;
+
+        std::ofstream out{sidecarPath(video)};
+        out << magic << ' ' << version << '\n'
+            << size << ' ' << modified << ' ' << frameCount << ' ' << std::setprecision(17) << fps << ' ' << keyframes.size() << '\n';
+        for (const auto &keyframe: keyframes)
+            out << keyframe.frame << ' ' << keyframe.ms << '\n';
+
+        return static_cast<bool>(out);
+    }
+
+    // Needs a backend with raw packet reads (CAP_PROP_FORMAT -1), FFmpeg has them.
+    bool build(const std::filesystem::path &video)
+    {
+        TRACE_SCOPE("KeyframeIndex::build");
+        keyframes.clear();
+        frameCount = 0;
+
+        cv::VideoCapture capture{video.string()};
+        if (!capture.isOpened() || !capture.set(cv::CAP_PROP_FORMAT, -1))
+            return false;
+
+        fps = capture.get(cv::CAP_PROP_FPS);
+        for (; capture.grab(); ++frameCount)
+            if (capture.get(cv::CAP_PROP_LRF_HAS_KEY_FRAME) != 0)
+                keyframes.push_back({frameCount, capture.get(cv::CAP_PROP_POS_MSEC)});
+
+        return !keyframes.empty();
+    }
+
+    // Loads the index of video, building and saving it when the sidecar is missing, stale or rebuild is set.
+    bool open(const std::filesystem::path &video, bool rebuild = false)
+    {
+        if (!rebuild && load(video))
+            return true;
+
+        if (!build(video))
+            return false;
+
+        if (!save(video))
+            std::cerr << "Cannot write " << sidecarPath(video) << '\n';
+
+        return true;
+    }
+
+    // The last keyframe at or before frame, where decoding has to start to reach it. Without an index
+    // that is frame itself, the backend then finds the keyframe on its own.
+    [[nodiscard]] int64_t keyframeBefore(int64_t frame) const
+    {
+        if (keyframes.empty())
+            return frame;
+
+        const auto after = std::ranges::upper_bound(keyframes, frame, {}, &Keyframe::frame);
+
+        return after == keyframes.begin() ? 0 : std::prev(after)->frame;
+    }
+
+    [[nodiscard]] const std::vector<Keyframe> &getKeyframes() const
+    {
+        return keyframes;
+    }
+
+    [[nodiscard]] int64_t getFrameCount() const
+    {
+        return frameCount;
+    }
+
+    [[nodiscard]] double getFps() const
+    {
+        return fps;
+    }
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "ChannelHistograms.hpp"
+#include "Luminance.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+// B, G, R and luminance histograms of the last frames of a stream, updated incrementally. Each frame
+// contributes one pixel in stride along both axes, at an offset that moves from frame to frame, so a
+// still scene is covered in full every stride * stride frames. The counts of the last frames are kept
+// in a ring: a new frame's counts are added to the totals and those of the frame leaving it subtracted.
+class RollingHistogram
+{
+public:
+    using Counts = std::array<std::array<uint32_t, 256>, 4>;
+
+private:
+    int stride;
+    std::vector<Counts> window;
+    size_t next = 0;
+    size_t filled = 0;
+    uint64_t frame = 0;
+    Counts totals{};
+
+public:
+    explicit RollingHistogram(int samplingStride = 4, size_t windowFrames = 8) : stride(std::max(1, samplingStride)), window(std::max<size_t>(1, windowFrames))
+    {
+    }
+
+    void add(const cv::Mat &image)
+    {
+        TRACE_SCOPE("RollingHistogram::add");
+        CV_Assert(image.type() == CV_8UC3);
+
+        auto &counts = window[next];
+        if (filled == window.size())
+        {
+            for (size_t channel = 0; channel < counts.size(); ++channel)
+                for (size_t bin = 0; bin < counts[channel].size(); ++bin)
+                    totals[channel][bin] -= counts[channel][bin];
+        }
+        else
+        {
+            filled++;
+        }
+
+        for (auto &histogram: counts)
+            histogram.fill(0);
+
+        const auto offsetX = static_cast<int>(frame % stride);
+        const auto offsetY = static_cast<int>(frame / stride % stride);
+        frame++;
+
+        for (auto y = offsetY; y < image.rows; y += stride)
+        {
+            const auto *p = image.ptr<uchar>(y) + offsetX * 3;
+            for (auto x = offsetX; x < image.cols; x += stride, p += 3 * stride)
+            {
+                counts[0][p[0]]++;
+                counts[1][p[1]]++;
+                counts[2][p[2]]++;
+                counts[3][luminance(p)]++;
+            }
+        }
+
+        for (size_t channel = 0; channel < counts.size(); ++channel)
+            for (size_t bin = 0; bin < counts[channel].size(); ++bin)
+                totals[channel][bin] += counts[channel][bin];
+
+        next = (next + 1) % window.size();
+    }
+
+    // B, G and R, then luminance.
+    [[nodiscard]] const Counts &getTotals() const
+    {
+        return totals;
+    }
+
+    void getColours(ChannelHistograms &histograms) const
+    {
+        std::copy(totals.begin(), totals.begin() + 3, histograms.bins.begin());
+
+        histograms.samples = 0;
+        for (const auto count: totals[0])
+            histograms.samples += count;
+    }
+};
+
+// Global luminance equalisation for video. The target mapping is the equalizationLut of the rolling
+// luminance histogram, and the mapping applied follows it as an exponential moving average, so a
+// passing object cannot make the exposure flicker. Applying it is a single parallel pass that looks up
+// the new luminance of every pixel and shifts its channels by the change, as lab 7's equalizeLuminance
+// does.
+class TemporalEqualizer
+{
+    RollingHistogram histogram;
+    float response;
+    std::array<float, 256> smoothed{};
+    bool primed = false;
+    LuminanceLut lut{};
+
+public:
+    // response is the weight of the newest target mapping, 1 follows every frame.
+    explicit TemporalEqualizer(int samplingStride = 4, size_t windowFrames = 8, float lutResponse = 0.1f) : histogram(samplingStride, windowFrames), response(lutResponse)
+    {
+    }
+
+    void apply(const cv::Mat &src, cv::Mat &dst)
+    {
+        TRACE_SCOPE("TemporalEqualizer::apply");
+        if (src.type() != CV_8UC3)
+        {
+            src.copyTo(dst);
+            return;
+        }
+
+        histogram.add(src);
+        const auto target = equalizationLut(histogram.getTotals()[3]);
+
+        for (size_t bin = 0; bin < lut.size(); ++bin)
+        {
+            smoothed[bin] = primed ? smoothed[bin] + response * (static_cast<float>(target[bin]) - smoothed[bin]) : target[bin];
+            lut[bin] = cv::saturate_cast<uchar>(smoothed[bin]);
+        }
+        primed = true;
+
+        dst.create(src.size(), CV_8UC3);
+        cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &range)
+                          {
+                              for (int y = range.start; y < range.end; ++y)
+                              {
+                                  const auto *in = src.ptr<uchar>(y);
+                                  auto *out = dst.ptr<uchar>(y);
+
+                                  for (int x = 0; x < src.cols; ++x, in += 3, out += 3)
+                                  {
+                                      const auto oldY = luminance(in);
+                                      shiftLuminance(in, out, lut[oldY], oldY);
+                                  }
+                              }
+                          });
+    }
+};
+
+// Draws the rolling colour histograms of the stream into the bottom left corner of each frame. The
+// corner is a view of the frame, which renderHistograms draws on without allocating as its size and
+// type already match.
+class HistogramOverlay
+{
+    RollingHistogram histogram;
+    ChannelHistograms colours;
+    cv::Size size;
+
+public:
+    explicit HistogramOverlay(int samplingStride = 4, size_t windowFrames = 8, cv::Size overlaySize = {256, 150}) : histogram(samplingStride, windowFrames), size(overlaySize)
+    {
+    }
+
+    void apply(const cv::Mat &src, cv::Mat &dst)
+    {
+        TRACE_SCOPE("HistogramOverlay::apply");
+        src.copyTo(dst);
+        if (src.type() != CV_8UC3)
+            return;
+
+        histogram.add(src);
+        histogram.getColours(colours);
+
+        const auto corner = cv::Rect{{0, dst.rows - size.height}, size} & cv::Rect{{0, 0}, dst.size()};
+        if (corner.empty())
+            return;
+
+        auto canvas = dst(corner);
+        renderHistograms(colours, canvas, corner.width, corner.height);
+    }
+};
@@ -0,0 +1,325 @@
+#pragma once
+
+#include "CaptureQueue.hpp"
+#include "KeyframeIndex.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <opencv2/videoio.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct SeekStats
+{
+    uint64_t seeks = 0;
+    uint64_t cacheHits = 0;
+    uint64_t superseded = 0;
+    uint64_t keyframeJumps = 0;
+    uint64_t decoded = 0;
+    uint64_t played = 0;
+    uint64_t playbackStalls = 0;
+    std::vector<double> latencyMs;
+
+    [[nodiscard]] static double percentile(std::vector<double> samples, double fraction)
+    {
+        if (samples.empty())
+            return 0;
+
+        std::sort(samples.begin(), samples.end());
+        return samples[std::min(samples.size() - 1, static_cast<size_t>(fraction * static_cast<double>(samples.size())))];
+    }
+
+    // superseded seeks were replaced by a newer one before their frame was shown, playback stalls are
+    // played frames that were not decoded ahead in time.
+    void print(std::ostream &out) const
+    {
+        out << "seeks " << seeks << ", from cache " << cacheHits << ", superseded " << superseded << ", keyframe jumps "
+            << keyframeJumps << ", frames decoded " << decoded << ", played " << played << " (stalled " << playbackStalls << ")\n"
+            << "seek ms p50 " << percentile(latencyMs, 0.5) << " p90 " << percentile(latencyMs, 0.9) << " p99 "
+            << percentile(latencyMs, 0.99) << " max " << percentile(latencyMs, 1) << '\n';
+    }
+};
+
+// Random access to a video file for scrubbing. seek() only records the target frame and a decode thread
+// with its own capture brings it in: from a cache of recently decoded frames around the playhead, by
+// reading on when the decoder already sits between the target and the keyframe before it, or else by
+// jumping to that keyframe and decoding forward. The keyframe is shown as soon as it is decoded, so a
+// scrub shows a nearby frame right away, and a newer target takes over between any two frames. Once
+// the target is shown the thread decodes a few frames ahead of it for playback.
+class SeekableReader
+{
+    using Clock = std::chrono::steady_clock;
+
+    const KeyframeIndex &index;
+    cv::VideoCapture capture;
+    size_t cacheFrames;
+    int64_t readAhead;
+    int64_t frameCount;
+
+    // Only touched by the decode thread.
+    int64_t position = 0;
+    cv::Mat spare;
+
+    mutable std::mutex mutex;
+    std::condition_variable_any wake;
+    std::condition_variable reachedChanged;
+    std::map<int64_t, cv::Mat> cache;
+    int64_t target = -1;
+    bool reached = true;
+    bool measured = false;
+    Clock::time_point requested;
+    int64_t end = std::numeric_limits<int64_t>::max();
+    cv::Mat published;
+    int64_t publishedFrame = -1;
+    uint64_t generation = 0;
+    uint64_t consumed = 0;
+    SeekStats stats;
+    std::jthread worker;
+
+    [[nodiscard]] bool hasWork() const
+    {
+        if (target < 0)
+            return false;
+
+        return !reached || (position > target && position <= target + readAhead && position < end);
+    }
+
+    // final marks the target as reached, otherwise image is a stand-in shown until it is.
+    void publish(int64_t frame, const cv::Mat &image, bool final)
+    {
+        published = image;
+        publishedFrame = frame;
+        generation++;
+
+        if (final)
+        {
+            reached = true;
+            if (measured)
+                stats.latencyMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - requested).count());
+            reachedChanged.notify_all();
+        }
+    }
+
+    // The published frame shares its buffer with a cache entry, so it never becomes the spare that the
+    // next read decodes into.
+    void recycle(cv::Mat &image)
+    {
+        if (spare.empty() && image.data != published.data)
+            spare = std::move(image);
+        else
+            image.release();
+    }
+
+    void evict()
+    {
+        while (cache.size() > cacheFrames)
+        {
+            const auto farthest = std::ranges::max_element(cache, {}, [&](const auto &entry) { return std::abs(entry.first - target); });
+            recycle(farthest->second);
+            cache.erase(farthest);
+        }
+    }
+
+    // Reads the frame at position with the lock released and caches it. jumped is set for the keyframe a
+    // seek has just jumped to.
+    void decodeNext(std::unique_lock<std::mutex> &lock, bool jumped)
+    {
+        const auto frame = position;
+        lock.unlock();
+        bool read;
+        {
+            TRACE_SCOPE("SeekableReader::read");
+            read = capture.read(spare) && !spare.empty();
+        }
+        lock.lock();
+
+        if (!read)
+        {
+            end = std::min(end, frame);
+            if (!reached && target >= frame)
+            {
+                reached = true;
+                reachedChanged.notify_all();
+            }
+            return;
+        }
+
+        position++;
+        stats.decoded++;
+
+        auto &slot = cache[frame];
+        std::swap(slot, spare);
+        if (!spare.empty())
+        {
+            cv::Mat previous = std::move(spare);
+            recycle(previous);
+        }
+
+        if (!reached && frame == target)
+            publish(frame, slot, true);
+        else if (!reached && jumped)
+            publish(frame, slot, false);
+
+        evict();
+    }
+
+    void decodeLoop(const std::stop_token &stopToken)
+    {
+        std::unique_lock lock{mutex};
+
+        while (wake.wait(lock, stopToken, [&]() { return hasWork(); }))
+        {
+            if (reached)
+            {
+                decodeNext(lock, false);
+                continue;
+            }
+
+            const auto goal = target;
+            if (const auto found = cache.find(goal); found != cache.end())
+            {
+                publish(goal, found->second, true);
+                continue;
+            }
+
+            const auto keyframe = index.keyframeBefore(goal);
+            const auto jump = position < keyframe || position > goal;
+            if (jump)
+            {
+                lock.unlock();
+                {
+                    TRACE_SCOPE("SeekableReader::jump");
+                    capture.set(cv::CAP_PROP_POS_FRAMES, static_cast<double>(keyframe));
+                }
+                lock.lock();
+
+                position = keyframe;
+                stats.keyframeJumps++;
+            }
+
+            decodeNext(lock, jump);
+        }
+    }
+
+    void request(int64_t frame, bool seek)
+    {
+        frame = std::clamp<int64_t>(frame, 0, std::max<int64_t>(0, frameCount - 1));
+
+        std::lock_guard lock{mutex};
+        if (frame == target)
+            return;
+
+        if (seek)
+        {
+            stats.seeks++;
+            if (!reached && measured)
+                stats.superseded++;
+        }
+        else
+        {
+            stats.played++;
+        }
+
+        target = frame;
+        reached = false;
+        measured = seek;
+        requested = Clock::now();
+
+        if (const auto found = cache.find(frame); found != cache.end())
+        {
+            if (seek)
+                stats.cacheHits++;
+            publish(frame, found->second, true);
+        }
+        else if (!seek)
+        {
+            stats.playbackStalls++;
+        }
+
+        wake.notify_one();
+    }
+
+public:
+    // Frame counts come from the index, or from the container when there is none.
+    SeekableReader(const std::string &video, const KeyframeIndex &keyframeIndex, size_t cachedFrames) : index(keyframeIndex), capture(video),
+                                                                                                     cacheFrames(std::max<size_t>(cachedFrames, 2)),
+                                                                                                     readAhead(static_cast<int64_t>(cacheFrames / 2))
+    {
+        frameCount = index.getFrameCount() ? index.getFrameCount() : static_cast<int64_t>(capture.get(cv::CAP_PROP_FRAME_COUNT));
+        worker = std::jthread{[this](const std::stop_token &stopToken) { decodeLoop(stopToken); }};
+    }
+
+    SeekableReader(SeekableReader &&reader) = delete;
+    SeekableReader &operator=(SeekableReader &&reader) = delete;
+    SeekableReader(SeekableReader const &reader) = delete;
+    SeekableReader &operator=(SeekableReader const &reader) = delete;
+
+    [[nodiscard]] bool isOpened() const
+    {
+        return capture.isOpened();
+    }
+
+    [[nodiscard]] int64_t getFrameCount() const
+    {
+        return frameCount;
+    }
+
+    // Makes frame the target, timed as a seek. Returns at once.
+    void seek(int64_t frame)
+    {
+        request(frame, true);
+    }
+
+    // Makes frame the target as the next frame of playback, which is not timed as a seek.
+    void play(int64_t frame)
+    {
+        request(frame, false);
+    }
+
+    // Copies the newest frame shown for the target into frame. Returns false when nothing new was
+    // published since the last call.
+    bool latest(Frame &frame)
+    {
+        std::lock_guard lock{mutex};
+        if (consumed == generation)
+            return false;
+
+        consumed = generation;
+        published.copyTo(frame.image);
+        frame.index = static_cast<uint64_t>(publishedFrame);
+        frame.captured = Clock::now();
+
+        return true;
+    }
+
+    [[nodiscard]] bool isReached() const
+    {
+        std::lock_guard lock{mutex};
+
+        return reached;
+    }
+
+    // Blocks until the current target is shown or found to be past the end. Returns false in that case.
+    bool waitUntilReached()
+    {
+        std::unique_lock lock{mutex};
+        reachedChanged.wait(lock, [&]() { return reached; });
+
+        return publishedFrame == target;
+    }
+
+    [[nodiscard]] SeekStats getStats() const
+    {
+        std::lock_guard lock{mutex};
+
+        return stats;
+    }
+};
@@ -0,0 +1,275 @@
+#pragma once
+
+#include "CaptureQueue.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <opencv2/videoio.hpp>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+struct RecorderStats
+{
+    uint64_t submitted = 0;
+    uint64_t written = 0;
+    uint64_t repeated = 0;
+    uint64_t dropped = 0;
+    uint64_t segments = 0;
+    size_t queueDepth = 0;
+    size_t maxQueueDepth = 0;
+    double encodeMsTotal = 0;
+    double encodeMsMax = 0;
+    double blockedMsTotal = 0;
+    bool failed = false;
+
+    // Encode fps is what the encoder thread sustains while busy, the ceiling for the recorded stream.
+    void print(std::ostream &out) const
+    {
+        out << "recorder: " << submitted << " submitted, " << written << " written (" << repeated << " repeated), "
+            << dropped << " dropped, " << segments << " segments, queue depth " << queueDepth << " (max " << maxQueueDepth << ")\n"
+            << "encode ms avg " << (written ? encodeMsTotal / static_cast<double>(written) : 0) << " max " << encodeMsMax
+            << ", encode fps " << (encodeMsTotal > 0 ? 1000. * static_cast<double>(written) / encodeMsTotal : 0)
+            << ", producer blocked " << blockedMsTotal << " ms\n";
+        if (failed)
+            out << "recording stopped: a segment could not be opened\n";
+    }
+};
+
+// Records frames to video files on an encoder thread. record() copies a frame into a bounded ring of
+// preallocated buffers and returns; like the CaptureQueue ring, buffers are swapped between the caller,
+// the ring and the encoder instead of being reallocated. When the ring is full, DropOldest overwrites
+// the oldest queued frame and Block waits for the encoder. Frames flagged unchanged are queued without
+// pixels and the encoder writes its previous frame again, so the recording keeps its timing. Output is
+// split into numbered segments once one reaches a size or duration limit, when either is set, and
+// whenever the frame size or channel count changes. If a segment cannot be opened, recording stops.
+class VideoRecorder
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::filesystem::path path;
+    int fourcc;
+    double fps;
+    OverflowPolicy policy;
+    uintmax_t segmentBytes;
+    uint64_t segmentFrames;
+
+    // Producer side.
+    Frame spare;
+
+    // Encoder side.
+    cv::VideoWriter writer;
+    std::filesystem::path segmentPath;
+    uint64_t framesInSegment = 0;
+    uint64_t nextSegment = 0;
+    bool failed = false;
+    cv::Size writerSize;
+    int writerChannels = 0;
+
+    mutable std::mutex mutex;
+    std::vector<Frame> slots;
+    size_t head = 0;
+    size_t size = 0;
+    bool closed = false;
+    RecorderStats stats;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::jthread worker;
+
+    // Without limits the recording goes to path itself, until a format change starts a numbered segment
+    // rather than overwriting it.
+    [[nodiscard]] std::filesystem::path nextSegmentPath(uint64_t segment) const
+    {
+        if (!segmentBytes && !segmentFrames && !segment)
+            return path;
+
+        std::ostringstream name;
+        name << path.stem().string() << '_' << std::setw(3) << std::setfill('0') << segment << path.extension().string();
+
+        return path.parent_path() / name.str();
+    }
+
+    [[nodiscard]] bool segmentFull() const
+    {
+        if (segmentFrames && framesInSegment >= segmentFrames)
+            return true;
+
+        std::error_code error;
+        return segmentBytes && std::filesystem::file_size(segmentPath, error) >= segmentBytes && !error;
+    }
+
+    // Opens the first segment, or the next one when the current is full or the frame format changed.
+    // A segment that fails to open ends the recording instead of being retried for every frame.
+    bool prepareWriter(const cv::Mat &image)
+    {
+        if (failed)
+            return false;
+
+        if (writer.isOpened() && image.size() == writerSize && image.channels() == writerChannels && !segmentFull())
+            return true;
+
+        writer.release();
+
+        segmentPath = nextSegmentPath(nextSegment++);
+        writerSize = image.size();
+        writerChannels = image.channels();
+        framesInSegment = 0;
+
+        TRACE_SCOPE("VideoRecorder::open");
+        const auto opened = writer.open(segmentPath.string(), fourcc, fps, writerSize, writerChannels == 3);
+        if (!opened)
+        {
+            std::cerr << "Cannot record to " << segmentPath << ", recording stopped\n";
+            failed = true;
+        }
+
+        std::lock_guard lock{mutex};
+        if (opened)
+            stats.segments++;
+        stats.failed = failed;
+
+        return opened;
+    }
+
+    void encodeLoop()
+    {
+        Frame frame;
+        cv::Mat previous;
+
+        for (;;)
+        {
+            {
+                std::unique_lock lock{mutex};
+                notEmpty.wait(lock, [&]() { return size > 0 || closed; });
+                if (!size)
+                    break;
+
+                std::swap(frame, slots[head]);
+                head = (head + 1) % slots.size();
+                size--;
+                notFull.notify_one();
+            }
+
+            const auto repeat = frame.unchanged || frame.image.empty();
+            if (repeat && previous.empty())
+                continue;
+
+            const auto start = Clock::now();
+            const auto &image = repeat ? previous : frame.image;
+            const auto opened = prepareWriter(image);
+            if (opened)
+            {
+                TRACE_SCOPE("VideoRecorder::write");
+                writer.write(image);
+                framesInSegment++;
+            }
+
+            // The written frame is kept for repeats, its old buffer goes back to the ring with the next pop.
+            if (!repeat)
+                std::swap(previous, frame.image);
+
+            const auto encodeMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+            std::lock_guard lock{mutex};
+            if (!opened)
+                continue;
+
+            stats.written++;
+            stats.repeated += repeat ? 1 : 0;
+            stats.encodeMsTotal += encodeMs;
+            stats.encodeMsMax = std::max(stats.encodeMsMax, encodeMs);
+        }
+
+        writer.release();
+    }
+
+public:
+    // segmentMegabytes and segmentSeconds of 0 record everything into outputPath; otherwise segments are
+    // named after it with a counter, e.g. out_000.avi.
+    VideoRecorder(std::filesystem::path outputPath, int codec, double framesPerSecond, size_t capacity, OverflowPolicy overflowPolicy,
+                  size_t segmentMegabytes = 0, double segmentSeconds = 0) : path(std::move(outputPath)), fourcc(codec), fps(framesPerSecond > 0 ? framesPerSecond : 30),
+                                                                           policy(overflowPolicy), segmentBytes(static_cast<uintmax_t>(segmentMegabytes) << 20),
+                                                                           segmentFrames(static_cast<uint64_t>(std::max(0., segmentSeconds) * fps)),
+                                                                           slots(std::max<size_t>(capacity, 1))
+    {
+        worker = std::jthread{[this]() { encodeLoop(); }};
+    }
+
+    ~VideoRecorder()
+    {
+        finish();
+    }
+
+    VideoRecorder(VideoRecorder &&recorder) = delete;
+    VideoRecorder &operator=(VideoRecorder &&recorder) = delete;
+    VideoRecorder(VideoRecorder const &recorder) = delete;
+    VideoRecorder &operator=(VideoRecorder const &recorder) = delete;
+
+    // Queues a copy of frame. Only waits under the Block policy while the ring is full; call it from
+    // the consumer of the stream, never from the capture thread.
+    void record(const Frame &frame)
+    {
+        TRACE_SCOPE("VideoRecorder::record");
+        spare.unchanged = frame.unchanged || frame.image.empty();
+        if (!spare.unchanged)
+            frame.image.copyTo(spare.image);
+        spare.index = frame.index;
+        spare.captured = frame.captured;
+
+        std::unique_lock lock{mutex};
+        if (closed)
+            return;
+
+        stats.submitted++;
+        if (size == slots.size())
+        {
+            if (policy == OverflowPolicy::Block)
+            {
+                const auto waiting = Clock::now();
+                notFull.wait(lock, [&]() { return size < slots.size(); });
+                stats.blockedMsTotal += std::chrono::duration<double, std::milli>(Clock::now() - waiting).count();
+            }
+            else
+            {
+                head = (head + 1) % slots.size();
+                size--;
+                stats.dropped++;
+            }
+        }
+
+        std::swap(slots[(head + size) % slots.size()], spare);
+        size++;
+        stats.maxQueueDepth = std::max(stats.maxQueueDepth, size);
+        notEmpty.notify_one();
+    }
+
+    // Encodes what is still queued and closes the file.
+    void finish()
+    {
+        {
+            std::lock_guard lock{mutex};
+            closed = true;
+            notEmpty.notify_all();
+        }
+
+        if (worker.joinable())
+            worker.join();
+    }
+
+    [[nodiscard]] RecorderStats getStats() const
+    {
+        std::lock_guard lock{mutex};
+        auto snapshot = stats;
+        snapshot.queueDepth = size;
+
+        return snapshot;
+    }
+};
@@ -1,13 +1,116 @@
+#include "CaptureQueue.hpp"
+#include "FramePipeline.hpp"
+#include "KeyframeIndex.hpp"
+#include "SeekableReader.hpp"
+#include "VideoRecorder.hpp"
+#include <chrono>
 #include <iostream>
 #include <opencv2/highgui.hpp>
 #include <opencv2/videoio.hpp>
+#include <random>
+
+// Random access playback of a video file: a trackbar scrubs through it, space plays and pauses, any
+// other key quits. Headless, it times a series of random seeks instead.
+int runScrub(const std::string &videoFile, const cv::CommandLineParser &parser)
+{
+    KeyframeIndex index;
+    const auto indexStart = std::chrono::steady_clock::now();
+    if (index.open(videoFile, parser.has("reindex")))
+        std::cout << "keyframe index: " << index.getKeyframes().size() << " keyframes over " << index.getFrameCount() << " frames in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - indexStart).count() << " ms\n";
+    else
+        std::cerr << "No keyframe index for " << videoFile << ", seeks decode from wherever the backend lands\n";
+
+    SeekableReader reader{videoFile, index, static_cast<size_t>(std::max(2, parser.get<int>("cache")))};
+    if (!reader.isOpened())
+        return -1;
+
+    const auto frames = std::max<int64_t>(1, reader.getFrameCount());
+    Frame frame;
+
+    if (parser.has("headless"))
+    {
+        std::mt19937 random{42};
+        std::uniform_int_distribution<int64_t> anyFrame{0, frames - 1};
+
+        for (int i = 0, seeks = std::max(1, parser.get<int>("seeks")); i < seeks; ++i)
+        {
+            reader.seek(anyFrame(random));
+            reader.waitUntilReached();
+        }
+
+        reader.getStats().print(std::cout);
+        TRACE_DUMP("lab3.trace.json");
+
+        return 0;
+    }
+
+    const std::string windowName = "Video";
+    const std::string trackbarName = "Frame";
+    const auto fps = index.getFps();
+    const auto frameDelay = fps > 0 ? std::max(1, cvRound(1000 / fps)) : std::max(1, parser.get<int>("delay"));
+
+    cv::namedWindow(windowName, cv::WINDOW_AUTOSIZE);
+    cv::createTrackbar(trackbarName, windowName, nullptr, static_cast<int>(frames - 1), [](int pos, void *userdata)
+                       {
+                           static_cast<SeekableReader *>(userdata)->seek(pos);
+                       }, &reader);
+    reader.seek(0);
+
+    auto playing = false;
+    for (;;)
+    {
+        if (reader.latest(frame))
+        {
+            TRACE_SCOPE("imshow");
+            cv::imshow(windowName, frame.image);
+        }
+
+        const auto key = cv::waitKey(playing ? frameDelay : 10);
+        if (key == ' ')
+            playing = !playing;
+        else if (key >= 0)
+            break;
+
+        // Playback moves on once the current frame is in, the trackbar follows without seeking again.
+        if (playing && reader.isReached() && static_cast<int64_t>(frame.index) + 1 < frames)
+        {
+            reader.play(static_cast<int64_t>(frame.index) + 1);
+            cv::setTrackbarPos(trackbarName, windowName, static_cast<int>(frame.index) + 1);
+        }
+    }
+
+    cv::destroyWindow(windowName);
+    reader.getStats().print(std::cout);
+    TRACE_DUMP("lab3.trace.json");
+
+    return 0;
+}
 
 
 int main(int argc, char **argv)
 {
     const char *keys = {
             "{help h usage? || print  this message}"
-            "{@video || Video file, if not defined try to use web camera}"};
+            "{@video || Video file, if not defined try to use web camera}"
+            "{queue | 4 | Number of preallocated frames between decode and display}"
+            "{policy | drop | What the decoder does when the queue is full: drop (oldest frame) or block}"
+            "{delay | 1 | waitKey delay between displayed frames, in ms}"
+            "{headless | | Consume frames without a window and print the counters}"
+            "{filters | | Filter chain run as a pipeline on the stream, e.g. blur,grey,sobel or equalize,histogram}"
+            "{scrub | | Random access mode for a video file: a frame trackbar seeks through a keyframe index, space plays and pauses}"
+            "{reindex | | Rebuild the keyframe index even when its sidecar file is up to date}"
+            "{cache | 32 | Decoded frames kept around the playhead in scrub mode}"
+            "{seeks | 200 | Random seeks timed by a headless scrub run}"
+            "{skipstatic | | Skip filtering and display of frames that barely differ from the last processed one}"
+            "{changeblock | 64 | Block side in pixels compared by --skipstatic}"
+            "{changethreshold | 4 | Mean grey level difference over a block that counts as a change}"
+            "{record | | Record the processed stream to this video file on an encoder thread}"
+            "{fourcc | MJPG | Codec of the recording, four characters}"
+            "{recordqueue | 8 | Frames buffered between the display loop and the encoder}"
+            "{recordpolicy | drop | What recording does when its queue is full: drop (oldest frame) or block}"
+            "{segmentmb | 0 | Start a new recording file after this many MB, 0 never}"
+            "{segmentsec | 0 | Start a new recording file after this many seconds of video, 0 never}"};
 
     cv::CommandLineParser parser{argc, argv, keys};
 
@@ -24,6 +127,17 @@ int main(int argc, char **argv)
     }
 
     auto videoFile = parser.get<cv::String>(0);
+    if (parser.has("scrub"))
+    {
+        if (videoFile.empty())
+        {
+            std::cerr << "Scrubbing needs a video file\n";
+            return -1;
+        }
+
+        return runScrub(videoFile, parser);
+    }
+
     cv::VideoCapture capture;
 
     if (!videoFile.empty())
@@ -34,27 +148,139 @@ int main(int argc, char **argv)
     if (!capture.isOpened())
         return -1;
 
-    const std::string windowName = "Video";
+    const auto policy = parser.get<cv::String>("policy") == "block" ? OverflowPolicy::Block : OverflowPolicy::DropOldest;
+    const auto delay = std::max(1, parser.get<int>("delay"));
+    const auto headless = parser.has("headless");
 
-    cv::namedWindow(windowName, cv::WINDOW_AUTOSIZE);
+    const auto capacity = static_cast<size_t>(std::max(1, parser.get<int>("queue")));
+    std::unique_ptr<ChangeDetector> detector;
+    if (parser.has("skipstatic"))
+        detector = std::make_unique<ChangeDetector>(parser.get<int>("changeblock"), parser.get<double>("changethreshold"));
+
+    CaptureQueue queue{capture, capacity, policy, detector.get()};
+    Frame frame;
+
+    std::unique_ptr<FramePipeline> pipeline;
+    if (parser.has("filters"))
+    {
+        std::vector<PipelineStage> stages;
+        if (!parseStages(parser.get<std::string>("filters"), stages))
+        {
+            std::cerr << "Unknown filter chain: " << parser.get<std::string>("filters") << '\n';
+            return -1;
+        }
+
+        pipeline = std::make_unique<FramePipeline>(queue, std::move(stages), capacity);
+    }
+
+    std::unique_ptr<VideoRecorder> recorder;
+    if (parser.has("record"))
+    {
+        const auto codec = parser.get<std::string>("fourcc");
+        if (codec.size() != 4)
+        {
+            std::cerr << "A codec is four characters, not " << codec << '\n';
+            return -1;
+        }
+
+        const auto recordPolicy = parser.get<cv::String>("recordpolicy") == "block" ? OverflowPolicy::Block : OverflowPolicy::DropOldest;
+        recorder = std::make_unique<VideoRecorder>(parser.get<std::string>("record"), cv::VideoWriter::fourcc(codec[0], codec[1], codec[2], codec[3]),
+                                                   capture.get(cv::CAP_PROP_FPS), static_cast<size_t>(std::max(1, parser.get<int>("recordqueue"))),
+                                                   recordPolicy, static_cast<size_t>(std::max(0, parser.get<int>("segmentmb"))),
+                                                   std::max(0., parser.get<double>("segmentsec")));
+    }
+
+    // Recording follows the display loop, so the capture thread never waits on the encoder.
+    const auto record = [&](const Frame &recorded)
+    {
+        if (recorder)
+            recorder->record(recorded);
+    };
 
-    while (true)
+    const auto start = [&]() { pipeline ? pipeline->start() : queue.start(); };
+    const auto next = [&](Frame &popped) { return pipeline ? pipeline->pop(popped) : queue.pop(popped); };
+    const auto presented = [&](const Frame &shown) { pipeline ? pipeline->markDisplayed(shown) : queue.markDisplayed(shown); };
+    double showMsTotal = 0;
+    const auto stop = [&]()
     {
-        cv::Mat frame;
+        pipeline ? pipeline->stop() : queue.stop();
+        queue.getStats().print(std::cout);
+        if (pipeline)
+            pipeline->getStats().print(std::cout);
+
+        if (recorder)
+        {
+            recorder->finish();
+            recorder->getStats().print(std::cout);
+        }
 
-        capture >> frame;
+        if (!detector)
+            return;
 
-        if (!frame.empty())
-            cv::imshow(windowName, frame);
+        // What a processed frame costs after decoding: the filter stages and display, or just imshow.
+        const auto &changes = detector->getStats();
+        auto processMs = showMsTotal;
+        if (pipeline)
+        {
+            const auto stats = pipeline->getStats();
+            processMs = 0;
+            for (const auto &stage: stats.stages)
+                if (stage.name != "decode")
+                    processMs += stage.busyMs;
+        }
 
-        if (cv::waitKey(30) >= 0)
+        const auto processed = changes.frames - changes.skipped;
+        changes.print(std::cout, processed ? processMs / static_cast<double>(processed) : 0);
+    };
+
+    if (headless)
+    {
+        start();
+
+        while (next(frame))
+        {
+            if (!frame.unchanged)
+                presented(frame);
+            record(frame);
+        }
+
+        stop();
+        capture.release();
+
+        TRACE_DUMP("lab3.trace.json");
+
+        return 0;
+    }
+
+    const std::string windowName = "Video";
+
+    cv::namedWindow(windowName, cv::WINDOW_AUTOSIZE);
+    start();
+
+    while (next(frame))
+    {
+        if (!frame.image.empty() && !frame.unchanged)
+        {
+            TRACE_SCOPE("imshow");
+            const auto shown = std::chrono::steady_clock::now();
+            cv::imshow(windowName, frame.image);
+            showMsTotal += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - shown).count();
+            presented(frame);
+        }
+        record(frame);
+
+        if (cv::waitKey(delay) >= 0)
             break;
     }
 
+    stop();
+
     cv::waitKey(0);
     cv::destroyWindow(windowName);
 
     capture.release();
 
+    TRACE_DUMP("lab3.trace.json");
+
     return 0;
 }
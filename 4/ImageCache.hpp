@@ -0,0 +1,215 @@
+#pragma once
+
+#include "ContentHash.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct CacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t duplicates = 0;
+    size_t bytes = 0;
+    size_t peakBytes = 0;
+};
+
+// Decoded images keyed by a hash of the encoded file contents, so the same picture opened under two
+// names is decoded and stored once. The total decoded size is kept under a budget by evicting the
+// least recently used images. Evicted images are decoded again by the next get().
+class ImageCache
+{
+    struct Entry
+    {
+        cv::Mat image;
+        std::list<uint64_t>::iterator recent;
+    };
+
+    size_t budget;
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, uint64_t> pathKeys;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::unordered_map<std::string, std::shared_future<cv::Mat>> loading;
+    std::list<uint64_t> recentlyUsed;
+    CacheStats stats;
+
+    static size_t imageBytes(const cv::Mat &image)
+    {
+        return image.total() * image.elemSize();
+    }
+
+    void touch(Entry &entry)
+    {
+        recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, entry.recent);
+    }
+
+    void evictOverBudget()
+    {
+        while (stats.bytes > budget && recentlyUsed.size() > 1)
+        {
+            const auto key = recentlyUsed.back();
+            recentlyUsed.pop_back();
+
+            auto found = entries.find(key);
+            stats.bytes -= imageBytes(found->second.image);
+            entries.erase(found);
+            stats.evictions++;
+        }
+    }
+
+    cv::Mat insert(uint64_t key, const cv::Mat &image)
+    {
+        if (auto found = entries.find(key); found != entries.end())
+        {
+            stats.duplicates++;
+            touch(found->second);
+            return found->second.image;
+        }
+
+        recentlyUsed.push_front(key);
+        entries.emplace(key, Entry{image, recentlyUsed.begin()});
+        stats.bytes += imageBytes(image);
+        stats.peakBytes = std::max(stats.peakBytes, stats.bytes);
+        evictOverBudget();
+
+        return image;
+    }
+
+    cv::Mat load(const std::string &path)
+    {
+        TRACE_SCOPE("ImageCache::load");
+        std::ifstream file{path, std::ios::binary | std::ios::ate};
+        if (!file)
+            return {};
+
+        std::vector<uchar> buffer(static_cast<size_t>(file.tellg()));
+        if (buffer.empty())
+            return {};
+
+        file.seekg(0);
+        if (!file.read(reinterpret_cast<char *>(buffer.data()), static_cast<std::streamsize>(buffer.size())))
+            return {};
+
+        const auto key = contentHash(buffer.data(), buffer.size());
+        {
+            std::lock_guard lock{mutex};
+            pathKeys[path] = key;
+            if (auto found = entries.find(key); found != entries.end())
+            {
+                stats.duplicates++;
+                touch(found->second);
+                return found->second.image;
+            }
+        }
+
+        auto image = cv::imdecode(buffer, cv::IMREAD_COLOR);
+        if (image.empty())
+            return image;
+
+        std::lock_guard lock{mutex};
+        return insert(key, image);
+    }
+
+public:
+    explicit ImageCache(size_t budgetBytes) : budget(budgetBytes)
+    {
+    }
+
+    // Returns the decoded image, decoding it on a miss. Concurrent requests for the same path wait for
+    // a single decode. An empty Mat means the file could not be read or decoded.
+    cv::Mat get(const std::filesystem::path &filePath)
+    {
+        const auto path = filePath.string();
+        std::promise<cv::Mat> promise;
+        std::shared_future<cv::Mat> pending;
+
+        {
+            std::unique_lock lock{mutex};
+
+            if (auto key = pathKeys.find(path); key != pathKeys.end())
+                if (auto found = entries.find(key->second); found != entries.end())
+                {
+                    stats.hits++;
+                    touch(found->second);
+                    return found->second.image;
+                }
+
+            if (auto found = loading.find(path); found != loading.end())
+            {
+                stats.hits++;
+                pending = found->second;
+            }
+            else
+            {
+                stats.misses++;
+                loading.emplace(path, promise.get_future().share());
+            }
+        }
+
+        if (pending.valid())
+            return pending.get();
+
+        // Waiters share this load, so a failure still has to resolve the promise and clear the entry
+        // rather than leave them with a broken promise.
+        cv::Mat image;
+        try
+        {
+            image = load(path);
+        }
+        catch (const std::exception &error)
+        {
+            std::cerr << "Cannot load " << path << ": " << error.what() << '\n';
+        }
+        promise.set_value(image);
+
+        std::lock_guard lock{mutex};
+        loading.erase(path);
+
+        return image;
+    }
+
+    // Decodes the files on a pool of threads in the background, stopping early once the budget is full.
+    [[nodiscard]] std::vector<std::jthread> prefetch(std::vector<std::filesystem::path> paths, unsigned threads)
+    {
+        auto queue = std::make_shared<std::vector<std::filesystem::path>>(std::move(paths));
+        auto next = std::make_shared<std::atomic<size_t>>(0);
+        std::vector<std::jthread> pool;
+
+        for (unsigned i = 0; i < std::max(1u, threads); ++i)
+            pool.emplace_back([this, queue, next](const std::stop_token &stopToken)
+                              {
+                                  for (auto index = (*next)++; index < queue->size() && !stopToken.stop_requested(); index = (*next)++)
+                                  {
+                                      {
+                                          std::lock_guard lock{mutex};
+                                          if (stats.bytes >= budget)
+                                              return;
+                                      }
+
+                                      get((*queue)[index]);
+                                  }
+                              });
+
+        return pool;
+    }
+
+    [[nodiscard]] CacheStats getStats() const
+    {
+        std::lock_guard lock{mutex};
+        return stats;
+    }
+};
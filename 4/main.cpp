@@ -1,16 +1,34 @@
+#include "Annotation.hpp"
+#include "ImageCache.hpp"
+#include "IntegralBlur.hpp"
+#include "JobRunner.hpp"
 #include <filesystem>
 #include <iostream>
+#include <mutex>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/videoio.hpp>
 #include <utility>
+#include <vector>
 
 static const int count = 100;
 class ImageWindow
 {
     std::string name;
-    cv::Mat image;
+    std::filesystem::path path;
+    ImageCache &cache;
+    JobRunner &jobs;
+
+    // Written by the callbacks, consumed by the next render job.
+    std::mutex requestMutex;
+    int requestedValue = 0;
+    std::vector<cv::Point> clicks;
+
+    // Only touched by the render jobs, which never overlap for one window.
+    cv::Mat annotated;
+    cv::Mat blurred;
     int filterValue = 0;
+    IntegralBlur boxBlur{count};
 
     static void onTrackbar(int pos, void *userdata)
     {
@@ -27,18 +45,69 @@ class ImageWindow
             return;
 
         auto window = static_cast<ImageWindow *>(userInput);
-        cv::circle(window->image, cv::Point(x, y), 10, cv::Scalar(0, 255, 0), 3);
+        window->annotate(cv::Point(x, y));
+    };
+
+    void requestRender()
+    {
+        jobs.submit(this, "view", [this](const std::stop_token &stopToken) { return render(stopToken); });
+    }
+
+    // Brings the view up to the latest request. Clicks only re-blur around the new annotations while the
+    // kernel stays the same; a stopped blur leaves blurred incomplete, so the next render starts over.
+    JobRunner::Present render(const std::stop_token &stopToken)
+    {
+        TRACE_SCOPE("ImageWindow::render");
+
+        int value;
+        std::vector<cv::Point> points;
+        {
+            std::lock_guard lock{requestMutex};
+            value = requestedValue;
+            points.swap(clicks);
+        }
 
+        cv::Rect changed;
+        for (const auto &point: points)
+        {
+            // The cached image may be shared with other windows and can be evicted, annotations go to a private copy.
+            if (annotated.empty())
+                annotated = image().clone();
 
-        if (window->filterValue)
-            window->applyFilter(window->filterValue);
+            changed |= drawAnnotation(annotated, point);
+        }
+
+        if (!value)
+        {
+            boxBlur.invalidate();
+            return [name = name, shown = annotated.empty() ? image() : annotated.clone()]() { cv::imshow(name, shown); };
+        }
+
+        bool done;
+        if (value == filterValue && !changed.empty())
+        {
+            done = boxBlur.update(annotated, value, changed, blurred, stopToken);
+        }
         else
-            window->show();
-    };
+        {
+            if (!changed.empty())
+                boxBlur.invalidate();
+
+            const auto source = image();
+            assert(source.data);
+            done = boxBlur.apply(source, value, blurred, stopToken);
+        }
+
+        filterValue = done ? value : 0;
+        if (!done)
+            return {};
+
+        return [name = name, shown = blurred.clone()]() { cv::imshow(name, shown); };
+    }
 
 public:
     using UniPtr = std::unique_ptr<ImageWindow>;
-    ImageWindow(std::string windowName, cv::Mat windowImage, int flags) : name(std::move(windowName)), image(std::move(windowImage))
+    ImageWindow(std::string windowName, std::filesystem::path imagePath, ImageCache &imageCache, JobRunner &jobRunner, int flags) : name(std::move(windowName)), path(std::move(imagePath)), cache(imageCache), jobs(jobRunner)
     {
         cv::namedWindow(name, flags);
 
@@ -48,6 +117,8 @@ public:
 
     ~ImageWindow()
     {
+        jobs.cancel(this);
+
         if (!getName().empty())
             cv::destroyWindow(name);
     }
@@ -62,23 +133,44 @@ public:
         return name;
     }
 
+    [[nodiscard]] cv::Mat image() const
+    {
+        return annotated.empty() ? cache.get(path) : annotated;
+    }
+
     void applyFilter(int value)
     {
         if (!value)
             return;
 
-        filterValue = value;
+        {
+            std::lock_guard lock{requestMutex};
+            requestedValue = value;
+        }
 
-        cv::Mat imgBlur;
-        assert(image.data);
-        cv::blur(image, imgBlur, cv::Size(value, value));
+        requestRender();
+    }
+
+    void annotate(cv::Point point)
+    {
+        {
+            std::lock_guard lock{requestMutex};
+            clicks.push_back(point);
+        }
 
-        cv::imshow(name, imgBlur);
+        requestRender();
     }
 
-    void show() const
+    bool show() const
     {
-        cv::imshow(name, image);
+        TRACE_SCOPE("ImageWindow::show");
+        const auto source = image();
+        if (source.empty())
+            return false;
+
+        cv::imshow(name, source);
+
+        return true;
     }
 
     void move(int x, int y) const
@@ -91,7 +183,9 @@ int main(int argc, char **argv)
 {
     const char *keys = {
             "{help h usage? || print  this message}"
-            "{files | <none> | Image file list }"};
+            "{@files | | Image file list }"
+            "{cache | 1024 | Memory budget for decoded images, in MB}"
+            "{threads | 0 | Decoder threads prefetching the files, 0 uses every core}"};
 
     cv::CommandLineParser parser{argc, argv, keys};
 
@@ -107,30 +201,51 @@ int main(int argc, char **argv)
         return 0;
     }
 
+    std::vector<std::filesystem::path> paths;
+    for (int i = 1; i < argc; ++i)
+        if (argv[i][0] != '-')
+            paths.emplace_back(argv[i]);
+
+    ImageCache cache{static_cast<size_t>(std::max(1, parser.get<int>("cache"))) << 20};
+
+    auto threads = parser.get<unsigned>("threads");
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    auto prefetch = cache.prefetch(paths, threads);
+
+    JobRunner jobs;
     std::vector<ImageWindow::UniPtr> windows;
 
-    for (int i = 1; i < argc; ++i)
+    for (const auto &filePath: paths)
     {
-        const std::filesystem::path filePath(argv[i]);
         std::cout << filePath << std::endl;
-        auto image = cv::imread(filePath);
-        if (!image.data)
-        {
-            std::cerr << filePath << " image dismissing!\n";
-            return -1;
-        }
-
-        windows.emplace_back(std::make_unique<ImageWindow>(filePath.filename(), image, cv::WINDOW_AUTOSIZE));
+        windows.emplace_back(std::make_unique<ImageWindow>(filePath.filename(), filePath, cache, jobs, cv::WINDOW_AUTOSIZE));
     }
 
     for (int i = 0; const auto &window: windows)
     {
         const auto offset = 100 * i++;
         window->move(offset, offset);
-        window->show();
+        if (!window->show())
+        {
+            std::cerr << paths[i - 1] << " image dismissing!\n";
+            return -1;
+        }
     }
 
-    cv::waitKey(0);
+    // The callbacks only queue jobs, their results are shown from here.
+    while (cv::waitKey(10) < 0)
+        jobs.deliver();
+
+    windows.clear();
+    jobs.getStats().print(std::cout);
+
+    const auto stats = cache.getStats();
+    std::cout << "Image cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions << " evictions, "
+              << stats.duplicates << " duplicates, peak " << (stats.peakBytes >> 20) << " MB\n";
+
+    TRACE_DUMP("lab4.trace.json");
 
     return 0;
 }
@@ -0,0 +1,325 @@
+#pragma once
+
+#include "FilterGraph.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <opencv2/imgcodecs.hpp>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Parses a comma separated chain such as "blur,grey,sobel". The stages always run in the FilterGraph
+// order, exactly as they do when toggled interactively. Returns false on an unknown stage name.
+inline bool parseChain(const std::string &spec, std::set<FiltersType> &chain)
+{
+    std::stringstream stream{spec};
+    std::string stage;
+
+    while (std::getline(stream, stage, ','))
+    {
+        std::transform(stage.begin(), stage.end(), stage.begin(), [](unsigned char c) { return std::tolower(c); });
+
+        if (stage == "blur")
+            chain.insert(FiltersType::Blur);
+        else if (stage == "grey" || stage == "gray")
+            chain.insert(FiltersType::Grey);
+        else if (stage == "rgb")
+            chain.insert(FiltersType::RGB);
+        else if (stage == "sobel")
+            chain.insert(FiltersType::Sobel);
+        else if (!stage.empty())
+            return false;
+    }
+
+    if (chain.contains(FiltersType::Grey))
+        chain.erase(FiltersType::RGB);
+
+    return true;
+}
+
+// A directory is scanned recursively for image files, anything else is read as a list of paths.
+inline std::vector<std::filesystem::path> collectInputs(const std::filesystem::path &source)
+{
+    static const std::set<std::string> extensions = {".bmp", ".jpeg", ".jpg", ".png", ".tif", ".tiff", ".webp"};
+    std::vector<std::filesystem::path> files;
+
+    if (std::filesystem::is_directory(source))
+    {
+        for (const auto &entry: std::filesystem::recursive_directory_iterator(source))
+        {
+            auto extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+
+            if (entry.is_regular_file() && extensions.contains(extension))
+                files.push_back(entry.path());
+        }
+
+        std::sort(files.begin(), files.end());
+    }
+    else
+    {
+        std::ifstream list{source};
+        for (std::string line; std::getline(list, line);)
+            if (!line.empty())
+                files.emplace_back(line);
+    }
+
+    return files;
+}
+
+struct StageTiming
+{
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> nanoseconds{0};
+
+    void add(std::chrono::steady_clock::duration elapsed)
+    {
+        count++;
+        nanoseconds += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    [[nodiscard]] double averageMs() const
+    {
+        return count ? static_cast<double>(nanoseconds) / 1e6 / static_cast<double>(count) : 0;
+    }
+};
+
+// Runs the lab 5 filter chain over a list of files without a display. Every worker takes the most
+// advanced piece of work available (encode, then filter, then decoding a new file), and no more than
+// maxInFlight images are decoded but not yet encoded at any time, which bounds memory. Results keep
+// their path relative to the input root below the output directory, or to the working directory when
+// the inputs came from a list.
+class BatchRunner
+{
+    struct Job
+    {
+        std::filesystem::path path;
+        cv::Mat image;
+    };
+
+    std::vector<std::filesystem::path> files;
+    std::set<FiltersType> chain;
+    std::filesystem::path inputRoot;
+    std::filesystem::path outputDirectory;
+    size_t maxInFlight;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Job> filterQueue;
+    std::deque<Job> encodeQueue;
+    size_t nextFile = 0;
+    size_t inFlight = 0;
+
+    StageTiming decodeTiming;
+    StageTiming filterTiming;
+    StageTiming encodeTiming;
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> bytesWritten{0};
+    std::atomic<uint64_t> failed{0};
+
+    [[nodiscard]] bool finished() const
+    {
+        return nextFile == files.size() && !inFlight;
+    }
+
+    void decode(Job &job)
+    {
+        TRACE_SCOPE("BatchRunner::decode");
+        const auto start = std::chrono::steady_clock::now();
+        job.image = cv::imread(job.path.string());
+        decodeTiming.add(std::chrono::steady_clock::now() - start);
+
+        std::error_code error;
+        const auto size = std::filesystem::file_size(job.path, error);
+        if (!error)
+            bytesRead += size;
+    }
+
+    void filter(Job &job)
+    {
+        TRACE_SCOPE("BatchRunner::filter");
+        const auto start = std::chrono::steady_clock::now();
+
+        // Nothing is reused between images, so the chain always runs as one fused pass.
+        FilterGraph graph{job.image};
+        graph.setFused(true);
+        for (const auto stage: chain)
+            graph.setEnabled(stage, true);
+        job.image = graph.evaluate();
+
+        filterTiming.add(std::chrono::steady_clock::now() - start);
+    }
+
+    // Inputs outside the root, which only a list can name, fall back to their file name.
+    [[nodiscard]] std::filesystem::path outputPath(const std::filesystem::path &input) const
+    {
+        std::error_code error;
+        auto relative = inputRoot.empty() ? std::filesystem::relative(input, error) : std::filesystem::relative(input, inputRoot, error);
+        if (error || relative.empty() || *relative.begin() == "..")
+            relative = input.filename();
+
+        return outputDirectory / relative;
+    }
+
+    // True when the output directory is the input root or lies below it, where results would be
+    // written over the sources or picked up as inputs by the next run.
+    [[nodiscard]] bool outputInsideInput() const
+    {
+        if (inputRoot.empty() || outputDirectory.empty())
+            return false;
+
+        std::error_code error;
+        const auto root = std::filesystem::weakly_canonical(inputRoot, error);
+        const auto output = std::filesystem::weakly_canonical(outputDirectory, error);
+        if (error)
+            return false;
+
+        const auto relative = output.lexically_relative(root);
+
+        return !relative.empty() && *relative.begin() != "..";
+    }
+
+    bool encode(const Job &job)
+    {
+        TRACE_SCOPE("BatchRunner::encode");
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<uchar> buffer;
+        auto extension = job.path.extension().string();
+        auto ok = cv::imencode(extension.empty() ? ".png" : extension, job.image, buffer);
+
+        if (ok && !outputDirectory.empty())
+        {
+            const auto path = outputPath(job.path);
+            std::error_code error;
+            std::filesystem::create_directories(path.parent_path(), error);
+
+            // A list can still name a file inside the output directory; never write over an input.
+            if (error || std::filesystem::equivalent(path, job.path, error))
+                return false;
+
+            std::ofstream output{path, std::ios::binary};
+            output.write(reinterpret_cast<const char *>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+            ok = static_cast<bool>(output);
+        }
+
+        encodeTiming.add(std::chrono::steady_clock::now() - start);
+        bytesWritten += buffer.size();
+
+        return ok;
+    }
+
+    void work()
+    {
+        std::unique_lock lock{mutex};
+
+        while (true)
+        {
+            changed.wait(lock, [&]() { return !encodeQueue.empty() || !filterQueue.empty() || (nextFile < files.size() && inFlight < maxInFlight) || finished(); });
+
+            if (!encodeQueue.empty())
+            {
+                auto job = std::move(encodeQueue.front());
+                encodeQueue.pop_front();
+                lock.unlock();
+
+                if (!encode(job))
+                {
+                    std::cerr << job.path << " could not be encoded\n";
+                    failed++;
+                }
+
+                job.image.release();
+                lock.lock();
+                inFlight--;
+                changed.notify_all();
+            }
+            else if (!filterQueue.empty())
+            {
+                auto job = std::move(filterQueue.front());
+                filterQueue.pop_front();
+                lock.unlock();
+
+                filter(job);
+
+                lock.lock();
+                encodeQueue.push_back(std::move(job));
+                changed.notify_one();
+            }
+            else if (nextFile < files.size() && inFlight < maxInFlight)
+            {
+                Job job{files[nextFile++]};
+                inFlight++;
+                lock.unlock();
+
+                decode(job);
+
+                lock.lock();
+                if (job.image.empty())
+                {
+                    std::cerr << job.path << " image dismissing!\n";
+                    failed++;
+                    inFlight--;
+                    changed.notify_all();
+                }
+                else
+                {
+                    filterQueue.push_back(std::move(job));
+                    changed.notify_one();
+                }
+            }
+            else
+            {
+                changed.notify_all();
+                return;
+            }
+        }
+    }
+
+public:
+    // root is the directory the inputs were collected from, empty for a list of files.
+    BatchRunner(std::vector<std::filesystem::path> inputs, std::filesystem::path root, std::set<FiltersType> filterChain, std::filesystem::path output, size_t inFlightLimit) : files(std::move(inputs)), chain(std::move(filterChain)), inputRoot(std::move(root)), outputDirectory(std::move(output)), maxInFlight(std::max<size_t>(inFlightLimit, 1))
+    {
+    }
+
+    // Returns the number of files that failed to decode or encode, all of them when the output
+    // directory is rejected.
+    uint64_t run(unsigned workers)
+    {
+        if (outputInsideInput())
+        {
+            std::cerr << "Output directory " << outputDirectory << " must not be inside the input directory " << inputRoot << '\n';
+            return files.size();
+        }
+
+        if (!outputDirectory.empty())
+            std::filesystem::create_directories(outputDirectory);
+
+        const auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::jthread> pool;
+            for (unsigned i = 0; i < std::max(workers, 1u); ++i)
+                pool.emplace_back([this]() { work(); });
+        }
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const auto processed = files.size() - failed;
+        std::cout << "Processed " << processed << " of " << files.size() << " images in " << seconds << " s\n"
+                  << "Throughput: " << static_cast<double>(processed) / seconds << " images/s, "
+                  << static_cast<double>(bytesRead) / (1 << 20) / seconds << " MB/s read, "
+                  << static_cast<double>(bytesWritten) / (1 << 20) / seconds << " MB/s written\n"
+                  << "Decode avg " << decodeTiming.averageMs() << " ms, filter avg " << filterTiming.averageMs()
+                  << " ms, encode avg " << encodeTiming.averageMs() << " ms\n";
+
+        return failed;
+    }
+};
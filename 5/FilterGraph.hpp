@@ -0,0 +1,232 @@
+#pragma once
+
+#include "FusedChain.hpp"
+#include "Trace.hpp"
+#include <array>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stop_token>
+
+struct GraphStats
+{
+    int reused = 0;
+    int recomputed = 0;
+};
+
+// A fixed Blur -> Grey -> RGB -> Sobel chain. Every node keeps its last output together with the key
+// of the upstream state it was computed from: the source generation and the enabled flags of every
+// node up to and including itself. Only nodes whose key changed are evaluated again.
+// In fused mode a run of two or more filters is evaluated as one applyFusedChain() pass that keeps
+// only the final output; the skipped intermediates are recomputed if a later change needs them.
+// A stopped evaluation leaves the remaining nodes with their old keys, so the next one redoes them.
+class FilterGraph
+{
+    struct FilterNode
+    {
+        FiltersType type;
+        bool enabled = false;
+        uint64_t key = 0;
+        cv::Mat output;
+    };
+
+    cv::Mat source;
+    uint64_t generation = 1;
+    std::array<FilterNode, 4> nodes = {FilterNode{FiltersType::Blur}, FilterNode{FiltersType::Grey},
+                                       FilterNode{FiltersType::RGB}, FilterNode{FiltersType::Sobel}};
+    GraphStats lastStats;
+    GraphStats totalStats;
+    bool fused = false;
+
+    static void run(FiltersType type, const cv::Mat &input, cv::Mat &output)
+    {
+        switch (type)
+        {
+            case FiltersType::Blur:
+            {
+                TRACE_SCOPE("FilterGraph::Blur");
+                cv::blur(input, output, cv::Size(5, 5));
+                break;
+            }
+            case FiltersType::Grey:
+            {
+                TRACE_SCOPE("FilterGraph::Grey");
+                cv::cvtColor(input, output, cv::COLOR_BGR2GRAY);
+                break;
+            }
+            case FiltersType::RGB:
+                output = input;
+                break;
+            case FiltersType::Sobel:
+            {
+                TRACE_SCOPE("FilterGraph::Sobel");
+                cv::Sobel(input, output, CV_8U, 1, 1);
+                break;
+            }
+        }
+    }
+
+    FilterNode &node(FiltersType type)
+    {
+        return nodes[static_cast<size_t>(type)];
+    }
+
+    using Keys = std::array<uint64_t, 4>;
+
+    void runEach(size_t start, const Keys &keys, const cv::Mat &input, const std::stop_token &stopToken)
+    {
+        const auto *current = &input;
+
+        for (auto i = start; i < nodes.size() && !stopToken.stop_requested(); ++i)
+        {
+            auto &node = nodes[i];
+            if (node.enabled)
+            {
+                // Never write into the old output, it may alias an upstream cache.
+                cv::Mat output;
+                run(node.type, *current, output);
+                node.output = output;
+                ++lastStats.recomputed;
+            }
+            else
+            {
+                node.output = *current;
+            }
+
+            node.key = keys[i];
+            current = &node.output;
+        }
+    }
+
+    // Returns false when the chain is not worth fusing and runEach() has to evaluate it. A stopped pass
+    // still returns true but leaves every key alone, so the next evaluation redoes it.
+    bool runFused(size_t start, const Keys &keys, const cv::Mat &input, const std::stop_token &stopToken)
+    {
+        bool enabled[4] = {};
+        size_t last = start;
+        int filters = 0;
+
+        for (auto i = start; i < nodes.size(); ++i)
+            if (nodes[i].enabled && nodes[i].type != FiltersType::RGB)
+            {
+                enabled[static_cast<size_t>(nodes[i].type)] = true;
+                last = i;
+                ++filters;
+            }
+
+        // A single filter gains nothing from fusing and keeps its OpenCV implementation.
+        cv::Mat output;
+        if (filters < 2 || !applyFusedChain(enabled[0], enabled[1], enabled[3], input, output, stopToken))
+            return false;
+
+        if (stopToken.stop_requested())
+            return true;
+
+        for (auto i = start; i < nodes.size(); ++i)
+        {
+            auto &node = nodes[i];
+            if (node.enabled)
+                ++lastStats.recomputed;
+
+            node.key = keys[i];
+            if (i < last)
+                node.output.release();
+            else
+                node.output = output;
+        }
+
+        return true;
+    }
+
+public:
+    FilterGraph() = default;
+
+    explicit FilterGraph(cv::Mat image) : source(std::move(image))
+    {
+    }
+
+    void setSource(cv::Mat image)
+    {
+        source = std::move(image);
+        invalidate();
+    }
+
+    // Call after the source pixels were modified in place.
+    void invalidate()
+    {
+        ++generation;
+    }
+
+    [[nodiscard]] bool isEnabled(FiltersType type) const
+    {
+        return nodes[static_cast<size_t>(type)].enabled;
+    }
+
+    void setEnabled(FiltersType type, bool enabled)
+    {
+        node(type).enabled = enabled;
+    }
+
+    void toggle(FiltersType type)
+    {
+        auto &current = node(type);
+        current.enabled = !current.enabled;
+    }
+
+    void setFused(bool enabled)
+    {
+        fused = enabled;
+    }
+
+    const cv::Mat &evaluate(const std::stop_token &stopToken = {})
+    {
+        TRACE_SCOPE("FilterGraph::evaluate");
+        lastStats = {};
+
+        // Keys accumulate the enabled flags, so once one node changed every node after it did too.
+        Keys keys{};
+        uint64_t mask = 0;
+        auto changed = nodes.size();
+
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            if (nodes[i].enabled)
+                mask |= uint64_t{1} << i;
+
+            keys[i] = (generation << nodes.size()) | mask;
+            if (changed == nodes.size() && nodes[i].key != keys[i])
+                changed = i;
+        }
+
+        // Restart from the closest stored output, a fused pass leaves its intermediates empty.
+        auto start = changed;
+        while (start < nodes.size() && start > 0 && nodes[start - 1].output.empty())
+            --start;
+
+        for (size_t i = 0; i < start; ++i)
+            if (nodes[i].enabled)
+                ++lastStats.reused;
+
+        if (start < nodes.size())
+        {
+            const auto &input = start ? nodes[start - 1].output : source;
+            if (!fused || !runFused(start, keys, input, stopToken))
+                runEach(start, keys, input, stopToken);
+        }
+
+        totalStats.reused += lastStats.reused;
+        totalStats.recomputed += lastStats.recomputed;
+
+        return nodes.back().output;
+    }
+
+    [[nodiscard]] const GraphStats &getLastStats() const
+    {
+        return lastStats;
+    }
+
+    [[nodiscard]] const GraphStats &getTotalStats() const
+    {
+        return totalStats;
+    }
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <array>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stop_token>
+
+enum class FiltersType
+{
+    Blur,
+    Grey,
+    RGB,
+    Sobel
+};
+
+// The lab 5 filters as they run on one strip of rows. radius is how many rows above and below an
+// output row the filter reads.
+template<FiltersType type>
+struct StripFilter;
+
+template<>
+struct StripFilter<FiltersType::Blur>
+{
+    static constexpr int radius = 2;
+
+    static void apply(const cv::Mat &in, cv::Mat &out)
+    {
+        cv::blur(in, out, cv::Size(5, 5));
+    }
+};
+
+template<>
+struct StripFilter<FiltersType::Grey>
+{
+    static constexpr int radius = 0;
+
+    static void apply(const cv::Mat &in, cv::Mat &out)
+    {
+        cv::cvtColor(in, out, cv::COLOR_BGR2GRAY);
+    }
+};
+
+template<>
+struct StripFilter<FiltersType::Sobel>
+{
+    static constexpr int radius = 1;
+
+    static void apply(const cv::Mat &in, cv::Mat &out)
+    {
+        cv::Sobel(in, out, CV_8U, 1, 1);
+    }
+};
+
+// A filter chain fixed at compile time, e.g. Chain<FiltersType::Grey, FiltersType::Blur, FiltersType::Sobel>,
+// run in the given order as one cache-blocked pass. The image is cut into full-width strips sized so a
+// strip of every intermediate fits in L2; each strip goes through all filters before the next one is
+// read, in per-thread buffers that are reused from strip to strip. A strip is read with the summed
+// radius of the chain above and below it, and after every filter only the rows that are still exact
+// are kept. Where a strip meets the top or bottom of the image it is that edge, so the filters' own
+// reflect 101 border gives the same rows as on the whole image and the result matches the multi-pass
+// chain byte for byte.
+template<FiltersType... types>
+struct Chain
+{
+    static_assert(sizeof...(types) > 0);
+
+    static constexpr int halo = (StripFilter<types>::radius + ...);
+    static constexpr bool toGrey = ((types == FiltersType::Grey) || ...);
+    static constexpr size_t cacheBytes = 256 << 10;
+
+    using Buffers = std::array<cv::Mat, sizeof...(types)>;
+
+    template<FiltersType type>
+    static void step(cv::Mat &current, cv::Range &covered, int &remaining, cv::Mat &buffer, cv::Range strip, int rows)
+    {
+        StripFilter<type>::apply(current, buffer);
+
+        remaining -= StripFilter<type>::radius;
+        const cv::Range needed{std::max(0, strip.start - remaining), std::min(rows, strip.end + remaining)};
+        current = buffer.rowRange(needed.start - covered.start, needed.end - covered.start);
+        covered = needed;
+    }
+
+    static void runStrip(const cv::Mat &src, cv::Mat &dst, cv::Range strip, Buffers &buffers)
+    {
+        auto remaining = halo;
+        cv::Range covered{std::max(0, strip.start - halo), std::min(src.rows, strip.end + halo)};
+        auto current = src.rowRange(covered);
+
+        size_t stage = 0;
+        (step<types>(current, covered, remaining, buffers[stage++], strip, src.rows), ...);
+
+        current.copyTo(dst.rowRange(strip));
+    }
+
+    // Checks stopToken before every strip and leaves the rest of dst unwritten once it fired.
+    static void apply(const cv::Mat &src, cv::Mat &dst, const std::stop_token &stopToken)
+    {
+        CV_Assert((src.type() == CV_8UC3 || (src.type() == CV_8UC1 && !toGrey)) && src.data != dst.data);
+
+        const auto rowBytes = std::max<size_t>(1, src.cols * src.elemSize());
+        const auto stripRows = std::max(2 * halo + 1, static_cast<int>(cacheBytes / rowBytes / sizeof...(types)));
+        const auto strips = (src.rows + stripRows - 1) / stripRows;
+
+        dst.create(src.size(), toGrey ? CV_8UC1 : src.type());
+
+        cv::parallel_for_(cv::Range(0, strips), [&](const cv::Range &range)
+                          {
+                              Buffers buffers;
+                              for (auto i = range.start; i < range.end && !stopToken.stop_requested(); ++i)
+                                  runStrip(src, dst, cv::Range(i * stripRows, std::min((i + 1) * stripRows, src.rows)), buffers);
+                          });
+    }
+};
+
+// Runs the enabled filters in FilterGraph order (Blur, Grey, Sobel; RGB passes through) through the
+// matching Chain specialisation. Returns false when no filter is enabled or for Grey on an image that
+// is not BGR. A pass stopped through stopToken returns true with dst incomplete; check the token.
+inline bool applyFusedChain(bool blur, bool grey, bool sobel, const cv::Mat &src, cv::Mat &dst, const std::stop_token &stopToken = {})
+{
+    TRACE_SCOPE("applyFusedChain");
+
+    using Kernel = void (*)(const cv::Mat &, cv::Mat &, const std::stop_token &);
+    static const std::array<Kernel, 8> kernels = {nullptr,
+                                                  Chain<FiltersType::Blur>::apply,
+                                                  Chain<FiltersType::Grey>::apply,
+                                                  Chain<FiltersType::Blur, FiltersType::Grey>::apply,
+                                                  Chain<FiltersType::Sobel>::apply,
+                                                  Chain<FiltersType::Blur, FiltersType::Sobel>::apply,
+                                                  Chain<FiltersType::Grey, FiltersType::Sobel>::apply,
+                                                  Chain<FiltersType::Blur, FiltersType::Grey, FiltersType::Sobel>::apply};
+
+    const auto mask = (blur ? 1 : 0) | (grey ? 2 : 0) | (sobel ? 4 : 0);
+    if (!mask || (src.type() != CV_8UC3 && (grey || src.type() != CV_8UC1)))
+        return false;
+
+    kernels[mask](src, dst, stopToken);
+
+    return true;
+}
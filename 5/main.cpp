@@ -1,25 +1,55 @@
+#include "Annotation.hpp"
+#include "BatchRunner.hpp"
+#include "FilterGraph.hpp"
+#include "IntegralBlur.hpp"
+#include "JobRunner.hpp"
+#include "PoolAllocator.hpp"
+#include "PreviewProxy.hpp"
+#include "ResultCache.hpp"
+#include <array>
 #include <filesystem>
 #include <iostream>
+#include <mutex>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/videoio.hpp>
-#include <set>
 #include <utility>
-
-enum class FiltersType
-{
-    Blur,
-    Grey,
-    RGB,
-    Sobel
-};
+#include <vector>
 
 static const int count = 100;
 class ImageWindow
 {
+    enum class View
+    {
+        Source,
+        Blur,
+        Filters
+    };
+
     std::string name;
+    JobRunner &jobs;
+    ResultCache &results;
+
+    // Written by the callbacks, consumed by the next render job.
+    std::mutex requestMutex;
+    View requestedView = View::Source;
+    int requestedValue = 0;
+    std::array<bool, 4> requestedFilters{};
+    std::vector<cv::Point> clicks;
+
+    // Only touched by the render jobs, which never overlap for one window.
+    View view = View::Source;
+    int value = 0;
+    std::array<bool, 4> filters{};
+    cv::Rect changed;
     cv::Mat image;
+    cv::Mat blurred;
     int filterValue = 0;
+    IntegralBlur boxBlur{count};
+    PreviewProxy proxy;
+    FilterGraph previewGraph;
+    uint64_t sourceHash = 0;
+    bool annotated = false;
 
     static void onTrackbar(int pos, void *userdata)
     {
@@ -36,29 +66,188 @@ class ImageWindow
             return;
 
         auto window = static_cast<ImageWindow *>(userInput);
-        cv::circle(window->image, cv::Point(x, y), 10, cv::Scalar(0, 255, 0), 3);
-
-
-        if (window->filterValue)
-            window->applyBasicFilterValue(window->filterValue);
-        else
-            window->show();
+        window->annotate(cv::Point(x, y));
     };
 
     template<FiltersType T>
     static void onClick([[maybe_unused]] int state, void *userData)
     {
         auto window = static_cast<ImageWindow *>(userData);
-        auto img = window->applyFilter(T);
-        window->show(img);
+        window->applyFilter(T);
     };
 
-    std::set<FiltersType> filters;
+    FilterGraph graph;
+
+    void requestRender()
+    {
+        if (proxy.enabled())
+            jobs.submit(this, "view", [this](const std::stop_token &stopToken) { return render(stopToken); }, [this](const std::stop_token &stopToken)
+                        {
+                            takeRequests();
+                            return renderPreview(stopToken);
+                        });
+        else
+            jobs.submit(this, "view", [this](const std::stop_token &stopToken)
+                        {
+                            takeRequests();
+                            return render(stopToken);
+                        });
+    }
+
+    // Moves the latest request into the job state and draws the new annotations. The changed area adds
+    // up until a full resolution render has taken it into account.
+    void takeRequests()
+    {
+        std::vector<cv::Point> points;
+        {
+            std::lock_guard lock{requestMutex};
+            view = requestedView;
+            value = requestedValue;
+            filters = requestedFilters;
+            points.swap(clicks);
+        }
+
+        cv::Rect drawn;
+        for (const auto &point: points)
+            drawn |= drawAnnotation(image, point);
+
+        if (drawn.empty())
+            return;
+
+        changed |= drawn;
+        annotated = true;
+        graph.invalidate();
+
+        if (proxy.enabled())
+        {
+            proxy.update(image, drawn);
+            previewGraph.invalidate();
+        }
+    }
+
+    // The current view computed on the proxy and scaled back up, as a stand-in until render() is done.
+    JobRunner::Present renderPreview(const std::stop_token &stopToken)
+    {
+        TRACE_SCOPE("ImageWindow::renderPreview");
+
+        cv::Mat preview;
+        switch (view)
+        {
+            case View::Source:
+                return {};
+            case View::Blur:
+            {
+                const auto ksize = proxy.scaleKernel(value);
+                cv::blur(proxy.get(), preview, cv::Size(ksize, ksize));
+                break;
+            }
+            case View::Filters:
+            {
+                for (size_t i = 0; i < filters.size(); ++i)
+                    previewGraph.setEnabled(static_cast<FiltersType>(i), filters[i]);
+
+                preview = previewGraph.evaluate(stopToken);
+                if (stopToken.stop_requested())
+                    return {};
+
+                break;
+            }
+        }
+
+        cv::Mat shown;
+        proxy.upscale(preview, shown);
+
+        return [name = name, shown]() { cv::imshow(name, shown); };
+    }
+
+    // Brings the current view up to the latest request. Clicks only re-blur around the new annotations
+    // while the kernel stays the same; a stopped blur leaves blurred incomplete, so the next render
+    // starts over, and a stopped graph evaluation resumes where it stopped.
+    JobRunner::Present render(const std::stop_token &stopToken)
+    {
+        TRACE_SCOPE("ImageWindow::render");
+
+        const auto region = std::exchange(changed, cv::Rect{});
+        const auto incremental = view == View::Blur && value == filterValue && !region.empty();
+        if (!region.empty() && !incremental)
+        {
+            boxBlur.invalidate();
+            filterValue = 0;
+        }
+
+        switch (view)
+        {
+            case View::Source:
+                return [name = name, shown = image.clone()]() { cv::imshow(name, shown); };
+            case View::Blur:
+            {
+                assert(image.data);
+                const auto done = incremental ? boxBlur.update(image, value, region, blurred, stopToken) : boxBlur.apply(image, value, blurred, stopToken);
+
+                filterValue = done ? value : 0;
+                if (!done)
+                    return {};
+
+                return [name = name, shown = blurred.clone()]() { cv::imshow(name, shown); };
+            }
+            case View::Filters:
+            {
+                // Filter results of the image as opened are kept in the result cache; the blur slider
+                // is not, every position would leave a full size file behind.
+                static const std::array<const char *, 4> filterNames = {" blur", " grey", "", " sobel"};
+                std::string operation = "filters";
+                for (size_t i = 0; i < filters.size(); ++i)
+                    if (filters[i])
+                        operation += filterNames[i];
+
+                const auto cacheable = results.enabled() && !annotated && operation != "filters";
+                const auto key = cacheable ? ResultCache::key(sourceHash, operation) : 0;
+                cv::Mat cached;
+                if (cacheable && results.load(key, cached))
+                    return [name = name, cached]()
+                    {
+                        cv::imshow(name, cached);
+                        cv::displayStatusBar(name, "Loaded from the result cache");
+                    };
+
+                for (size_t i = 0; i < filters.size(); ++i)
+                    graph.setEnabled(static_cast<FiltersType>(i), filters[i]);
+
+                const auto &result = graph.evaluate(stopToken);
+                if (stopToken.stop_requested())
+                    return {};
+
+                if (cacheable)
+                    results.store(key, result);
+
+                // With no filter enabled the graph hands back the source, which later clicks draw on.
+                const auto stats = graph.getLastStats();
+                return [name = name, shown = result.data == image.data ? image.clone() : result, stats]()
+                {
+                    cv::imshow(name, shown);
+                    cv::displayStatusBar(name, "Stages reused: " + std::to_string(stats.reused) + ", recomputed: " + std::to_string(stats.recomputed));
+                };
+            }
+        }
+
+        return {};
+    }
 
 public:
     using UniPtr = std::unique_ptr<ImageWindow>;
-    ImageWindow(std::string windowName, cv::Mat windowImage, int flags) : name(std::move(windowName)), image(std::move(windowImage))
+    ImageWindow(std::string windowName, cv::Mat windowImage, JobRunner &jobRunner, ResultCache &resultCache, int flags, bool fused = false, int previewSide = 0) : name(std::move(windowName)), jobs(jobRunner), results(resultCache), image(std::move(windowImage)), proxy(previewSide), graph(image)
     {
+        graph.setFused(fused);
+        if (results.enabled())
+            sourceHash = ResultCache::imageHash(image);
+
+        proxy.build(image);
+        if (proxy.enabled())
+        {
+            previewGraph.setSource(proxy.get());
+            previewGraph.setFused(fused);
+        }
+
         cv::namedWindow(name, flags);
 
         cv::createTrackbar(name, name, nullptr, count, onTrackbar, this);
@@ -77,6 +266,8 @@ public:
 
     ~ImageWindow()
     {
+        jobs.cancel(this);
+
         if (!getName().empty())
             cv::destroyWindow(name);
     }
@@ -96,60 +287,51 @@ public:
         if (!value)
             return;
 
-        filterValue = value;
-
-        cv::Mat imgBlur;
-        assert(image.data);
-        cv::blur(image, imgBlur, cv::Size(value, value));
+        {
+            std::lock_guard lock{requestMutex};
+            requestedView = View::Blur;
+            requestedValue = value;
+        }
 
-        cv::imshow(name, imgBlur);
+        requestRender();
     }
 
-    cv::Mat applyFilter(FiltersType filter)
+    void applyFilter(FiltersType filter)
     {
-        cv::Mat result;
-
-        if (filter == FiltersType::RGB)
-            filters.erase(FiltersType::Grey);
-        else if (filter == FiltersType::Grey)
-            filters.erase(FiltersType::RGB);
-
-        if (filters.contains(filter))
-            filters.erase(filter);
-        else
-            filters.emplace(filter);
-
-        image.copyTo(result);
+        {
+            std::lock_guard lock{requestMutex};
+            if (filter == FiltersType::RGB)
+                requestedFilters[static_cast<size_t>(FiltersType::Grey)] = false;
+            else if (filter == FiltersType::Grey)
+                requestedFilters[static_cast<size_t>(FiltersType::RGB)] = false;
+
+            auto &enabled = requestedFilters[static_cast<size_t>(filter)];
+            enabled = !enabled;
+            requestedView = View::Filters;
+        }
+
+        requestRender();
+    }
 
-        for (const auto currentFilter: filters)
-            switch (currentFilter)
-            {
-                case FiltersType::Blur:
-                    cv::blur(result, result, cv::Size(5, 5));
-                    break;
-                case FiltersType::Grey:
-                    cv::cvtColor(result, result, cv::COLOR_BGR2GRAY);
-                    break;
-                case FiltersType::RGB:
-                    break;
-                case FiltersType::Sobel:
-                    cv::Sobel(result, result, CV_8U, 1, 1);
-                    break;
-            }
+    // Like the synchronous callback did, a click shows the annotated image blurred with the last kernel
+    // size, or unblurred before the slider was moved, whatever view was active.
+    void annotate(cv::Point point)
+    {
+        {
+            std::lock_guard lock{requestMutex};
+            clicks.push_back(point);
+            requestedView = requestedValue ? View::Blur : View::Source;
+        }
 
-        return result;
+        requestRender();
     }
 
+    // Only before the first callback, afterwards the render jobs own the image.
     void show() const
     {
         cv::imshow(name, image);
     }
 
-    void show(cv::Mat &img)
-    {
-        cv::imshow(name, img);
-    }
-
     void move(int x, int y) const
     {
         cv::moveWindow(name, x, y);
@@ -160,7 +342,17 @@ int main(int argc, char **argv)
 {
     const char *keys = {
             "{help h usage? || print  this message}"
-            "{@files | <none> | Image file list }"};
+            "{@files | | Image file list }"
+            "{batch | | Run headless over a directory or a file listing one image path per line}"
+            "{chain | blur,grey,sobel | Filters applied in batch mode, comma separated: blur, grey, rgb, sobel}"
+            "{output | | Directory for batch results, encoded in memory only when empty}"
+            "{workers | 0 | Batch worker threads, 0 uses every core}"
+            "{inflight | 0 | Images decoded but not yet encoded at once in batch mode, 0 uses twice the workers}"
+            "{fused | | Run chains of two or more filters as one cache-blocked pass instead of one pass per filter}"
+            "{preview | 0 | Show every edit on a pyramid level at most this many pixels across before the full resolution result, 0 disables}"
+            "{pool | 256 | Keep up to this many MB of released image buffers for reuse, 0 disables}"
+            "{results | | Directory of the persistent result cache, disabled when empty}"
+            "{resultcap | 2048 | Size cap of the result cache in MB}"};
 
     cv::CommandLineParser parser{argc, argv, keys};
 
@@ -170,12 +362,53 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    if (!parser.check() || argc < 2)
+    if (!parser.check())
     {
         parser.printErrors();
         return 0;
     }
-    const std::filesystem::path filePath(argv[1]);
+
+    const auto poolBudget = static_cast<size_t>(std::max(0, parser.get<int>("pool"))) << 20;
+    const auto *pool = poolBudget ? &PoolAllocator::install(poolBudget) : nullptr;
+
+    if (parser.has("batch"))
+    {
+        std::set<FiltersType> chain;
+        if (!parseChain(parser.get<std::string>("chain"), chain))
+        {
+            std::cerr << "Unknown filter in chain " << parser.get<std::string>("chain") << '\n';
+            return -1;
+        }
+
+        auto workers = parser.get<unsigned>("workers");
+        if (!workers)
+            workers = std::max(1u, std::thread::hardware_concurrency());
+
+        auto inFlight = parser.get<unsigned>("inflight");
+        if (!inFlight)
+            inFlight = 2 * workers;
+
+        const std::filesystem::path source = parser.get<std::string>("batch");
+        BatchRunner runner{collectInputs(source), std::filesystem::is_directory(source) ? source : std::filesystem::path{}, chain,
+                           parser.get<std::string>("output"), inFlight};
+
+        const auto failures = runner.run(workers);
+        if (pool)
+            pool->getStats().print(std::cout);
+
+        TRACE_DUMP("lab5.trace.json");
+
+        return failures ? -1 : 0;
+    }
+
+    const auto fileName = parser.get<cv::String>(0);
+    if (fileName.empty())
+    {
+        parser.printMessage();
+        return 0;
+    }
+
+    const std::filesystem::path filePath(fileName);
     std::cout << filePath << std::endl;
     auto image = cv::imread(filePath);
     if (!image.data)
@@ -184,11 +417,23 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    ImageWindow window{filePath.filename(), image, cv::WINDOW_AUTOSIZE};
+    ResultCache results{parser.get<std::string>("results"), static_cast<size_t>(std::max(0, parser.get<int>("resultcap"))) << 20};
+    JobRunner jobs;
+    ImageWindow window{filePath.filename(), image, jobs, results, cv::WINDOW_AUTOSIZE, parser.has("fused"), parser.get<int>("preview")};
 
     window.show();
 
-    cv::waitKey(0);
+    // The callbacks only queue jobs, their results are shown from here.
+    while (cv::waitKey(10) < 0)
+        jobs.deliver();
+
+    jobs.getStats().print(std::cout);
+    if (pool)
+        pool->getStats().print(std::cout);
+    if (results.enabled())
+        results.getStats().print(std::cout);
+
+    TRACE_DUMP("lab5.trace.json");
 
     return 0;
 }
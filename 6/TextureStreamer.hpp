@@ -0,0 +1,231 @@
+#pragma once
+
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
+#include "Trace.hpp"
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+enum class UploadMode
+{
+    Reallocate,
+    SubImage,
+    PixelBuffers
+};
+
+// A rectangle of the frame, in pixels.
+struct UploadRegion
+{
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+struct UploadStats
+{
+    size_t frames = 0;
+    size_t partialFrames = 0;
+    size_t bytes = 0;
+    double lastMs = 0;
+    double totalMs = 0;
+    double maxMs = 0;
+
+    [[nodiscard]] double averageMs() const
+    {
+        return frames ? totalMs / static_cast<double>(frames) : 0;
+    }
+};
+
+// Uploads tightly or loosely packed 8-bit BGR frames into a texture. Reallocate is the old
+// glTexImage2D-per-frame path. SubImage allocates storage once per resolution and updates it in place.
+// PixelBuffers additionally stages every frame through a ring of pixel buffer objects. A buffer is only
+// written again once the rest of the ring has been used, by when the GPU has long finished reading it, so
+// the CPU copy into one buffer overlaps with the transfers from the others without orphaning any storage.
+class TextureStreamer
+{
+    GLuint texture;
+    UploadMode mode;
+    std::vector<GLuint> buffers;
+    size_t nextBuffer = 0;
+    std::vector<unsigned char> packed;
+    int width = 0;
+    int height = 0;
+    UploadStats stats;
+
+    // GL_UNPACK_ROW_LENGTH counts whole pixels, so rows whose step is not a multiple of a pixel are
+    // copied into a packed buffer first. Returns the rows to upload and updates step to match them.
+    const unsigned char *unpackRows(const unsigned char *data, int frameWidth, int frameHeight, size_t &step)
+    {
+        if (step % 3 == 0)
+            return data;
+
+        const auto rowBytes = static_cast<size_t>(frameWidth) * 3;
+        packed.resize(rowBytes * frameHeight);
+        for (int y = 0; y < frameHeight; ++y)
+            std::memcpy(packed.data() + rowBytes * y, data + step * y, rowBytes);
+
+        step = rowBytes;
+        return packed.data();
+    }
+
+    void allocate(int frameWidth, int frameHeight)
+    {
+        width = frameWidth;
+        height = frameHeight;
+
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, nullptr);
+
+        const auto bytes = static_cast<GLsizeiptr>(width) * height * 3;
+        for (const auto buffer: buffers)
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    void uploadThroughBuffer(const unsigned char *data, size_t step)
+    {
+        const auto rowBytes = static_cast<size_t>(width) * 3;
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[nextBuffer]);
+        nextBuffer = (nextBuffer + 1) % buffers.size();
+
+        auto *mapped = static_cast<unsigned char *>(glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY));
+
+        if (mapped)
+        {
+            if (step == rowBytes)
+                std::memcpy(mapped, data, rowBytes * height);
+            else
+                for (int y = 0; y < height; ++y)
+                    std::memcpy(mapped + rowBytes * y, data + step * y, rowBytes);
+
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, nullptr);
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    void record(std::chrono::steady_clock::time_point start, size_t bytes)
+    {
+        const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        stats.frames++;
+        stats.bytes += bytes;
+        stats.lastMs = ms;
+        stats.totalMs += ms;
+        stats.maxMs = ms > stats.maxMs ? ms : stats.maxMs;
+    }
+
+public:
+    TextureStreamer(GLuint textureId, UploadMode uploadMode, int bufferCount = 2) : texture(textureId), mode(uploadMode)
+    {
+        if (mode != UploadMode::PixelBuffers)
+            return;
+
+        buffers.resize(bufferCount < 1 ? 1 : bufferCount);
+        glGenBuffers(static_cast<GLsizei>(buffers.size()), buffers.data());
+    }
+
+    ~TextureStreamer()
+    {
+        if (!buffers.empty())
+            glDeleteBuffers(static_cast<GLsizei>(buffers.size()), buffers.data());
+    }
+
+    TextureStreamer(TextureStreamer &&streamer) = delete;
+    TextureStreamer &operator=(TextureStreamer &&streamer) = delete;
+    TextureStreamer(TextureStreamer const &streamer) = delete;
+    TextureStreamer &operator=(TextureStreamer const &streamer) = delete;
+
+    bool upload(const unsigned char *data, int frameWidth, int frameHeight, size_t step)
+    {
+        TRACE_SCOPE("TextureStreamer::upload");
+
+        if (!data || frameWidth <= 0 || frameHeight <= 0)
+            return false;
+
+        const auto start = std::chrono::steady_clock::now();
+
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+        if (mode == UploadMode::Reallocate)
+        {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            data = unpackRows(data, frameWidth, frameHeight, step);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(step / 3));
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, frameWidth, frameHeight, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        }
+        else
+        {
+            if (frameWidth != width || frameHeight != height)
+            {
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                allocate(frameWidth, frameHeight);
+            }
+
+            if (mode == UploadMode::SubImage)
+            {
+                data = unpackRows(data, frameWidth, frameHeight, step);
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(step / 3));
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, data);
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            }
+            else
+                uploadThroughBuffer(data, step);
+        }
+
+        record(start, static_cast<size_t>(frameWidth) * frameHeight * 3);
+
+        return true;
+    }
+
+    // Updates only regions of a texture that already holds the previous frame at this size, with one
+    // glTexSubImage2D each straight from the frame; staging a few small rectangles through the pixel
+    // buffers would not pay off. Anything else, including rows that cannot be described by a row length
+    // in pixels, falls back to a full upload.
+    bool uploadRegions(const unsigned char *data, int frameWidth, int frameHeight, size_t step, const std::vector<UploadRegion> &regions)
+    {
+        if (mode == UploadMode::Reallocate || frameWidth != width || frameHeight != height || regions.empty() || step % 3 != 0)
+            return upload(data, frameWidth, frameHeight, step);
+
+        TRACE_SCOPE("TextureStreamer::uploadRegions");
+        const auto start = std::chrono::steady_clock::now();
+
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(step / 3));
+
+        size_t bytes = 0;
+        for (const auto &region: regions)
+        {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, region.x, region.y, region.width, region.height, GL_BGR, GL_UNSIGNED_BYTE,
+                            data + step * region.y + static_cast<size_t>(region.x) * 3);
+            bytes += static_cast<size_t>(region.width) * region.height * 3;
+        }
+
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+        stats.partialFrames++;
+        record(start, bytes);
+
+        return true;
+    }
+
+    [[nodiscard]] const UploadStats &getStats() const
+    {
+        return stats;
+    }
+};
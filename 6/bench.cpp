@@ -0,0 +1,119 @@
+#include "TextureStreamer.hpp"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Headless upload benchmark. Creates an off-screen EGL context, which on machines without a GPU is
+// served by Mesa llvmpipe (without a display, run with EGL_PLATFORM=surfaceless LIBGL_ALWAYS_SOFTWARE=1),
+// and streams synthetic frames through every upload mode while drawing a textured quad like the lab does.
+static bool createContext(int width, int height)
+{
+    auto display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr))
+        return false;
+
+    const EGLint configAttributes[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                                       EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_NONE};
+    EGLConfig config;
+    EGLint configs = 0;
+    if (!eglChooseConfig(display, configAttributes, &config, 1, &configs) || !configs)
+        return false;
+
+    const EGLint surfaceAttributes[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+    auto surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+    if (surface == EGL_NO_SURFACE || !eglBindAPI(EGL_OPENGL_API))
+        return false;
+
+    auto context = eglCreateContext(display, config, EGL_NO_CONTEXT, nullptr);
+    if (context == EGL_NO_CONTEXT)
+        return false;
+
+    return eglMakeCurrent(display, surface, surface, context);
+}
+
+static void drawQuad(GLuint texture)
+{
+    glClear(GL_COLOR_BUFFER_BIT);
+    glLoadIdentity();
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f);
+    glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(1.0f, 0.0f);
+    glVertex2f(1.0f, -1.0f);
+    glTexCoord2f(1.0f, 1.0f);
+    glVertex2f(1.0f, 1.0f);
+    glTexCoord2f(0.0f, 1.0f);
+    glVertex2f(-1.0f, 1.0f);
+    glEnd();
+}
+
+static double median(std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    return samples.empty() ? 0 : samples[samples.size() / 2];
+}
+
+static void benchMode(const std::string &name, UploadMode mode, int buffers, int width, int height, int frames)
+{
+    std::vector<std::vector<unsigned char>> sources(3, std::vector<unsigned char>(static_cast<size_t>(width) * height * 3));
+    for (size_t i = 0; i < sources.size(); ++i)
+        std::fill(sources[i].begin(), sources[i].end(), static_cast<unsigned char>(40 * (i + 1)));
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+
+    std::vector<double> frameMs;
+    {
+        TextureStreamer streamer{texture, mode, buffers};
+
+        for (int i = 0; i < frames; ++i)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            streamer.upload(sources[i % sources.size()].data(), width, height, static_cast<size_t>(width) * 3);
+            drawQuad(texture);
+            glFlush();
+            frameMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        glFinish();
+
+        std::cout << std::left << std::setw(14) << name << std::right << std::setw(5) << width << 'x' << std::setw(4) << height
+                  << std::fixed << std::setprecision(2)
+                  << "  upload avg " << std::setw(7) << streamer.getStats().averageMs() << " ms"
+                  << "  max " << std::setw(7) << streamer.getStats().maxMs << " ms"
+                  << "  frame median " << std::setw(7) << median(frameMs) << " ms\n";
+    }
+
+    glDeleteTextures(1, &texture);
+}
+
+int main(int argc, char **argv)
+{
+    const auto frames = argc > 1 ? std::max(1, std::atoi(argv[1])) : 120;
+
+    if (!createContext(64, 64))
+    {
+        std::cerr << "Could not create an off-screen OpenGL context\n";
+        return 1;
+    }
+
+    std::cout << "GL renderer: " << glGetString(GL_RENDERER) << '\n';
+    glEnable(GL_TEXTURE_2D);
+
+    const std::vector<std::pair<int, int>> sizes = {{1280, 720}, {1920, 1080}, {3840, 2160}};
+    for (const auto &[width, height]: sizes)
+    {
+        benchMode("teximage", UploadMode::Reallocate, 0, width, height, frames);
+        benchMode("subimage", UploadMode::SubImage, 0, width, height, frames);
+        benchMode("pbo x2", UploadMode::PixelBuffers, 2, width, height, frames);
+        benchMode("pbo x3", UploadMode::PixelBuffers, 3, width, height, frames);
+    }
+
+    return 0;
+}
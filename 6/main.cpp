@@ -1,4 +1,5 @@
-#include <GL/gl.h>
+#include "ChangeDetector.hpp"
+#include "TextureStreamer.hpp"
 #include <filesystem>
 #include <iostream>
 #include <opencv2/highgui.hpp>
@@ -11,9 +12,13 @@ class ImageWindow
     GLuint texture;
     GLfloat angle = 0.f;
     cv::VideoCapture capture;
+    std::unique_ptr<TextureStreamer> streamer;
+    ChangeDetector *detector;
+    std::vector<UploadRegion> regions;
 
     static void onDraw(void *param)
     {
+        TRACE_SCOPE("ImageWindow::onDraw");
         auto image = static_cast<ImageWindow *>(param);
 
         glLoadIdentity();
@@ -31,33 +36,24 @@ class ImageWindow
         glEnd();
     }
 
-    static bool loadTexture(const cv::Mat &frame, GLuint texture)
-    {
-        if (!frame.data)
-            return false;
-
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, frame.cols, frame.rows, 0, GL_BGR, GL_UNSIGNED_BYTE, frame.data);
-
-        return true;
-    }
-
 public:
     using UniPtr = std::unique_ptr<ImageWindow>;
-    ImageWindow(std::string windowName, const cv::VideoCapture& videoCapture, int flags) : name(std::move(windowName)), capture(videoCapture)
+    ImageWindow(std::string windowName, const cv::VideoCapture& videoCapture, int flags, UploadMode uploadMode, int uploadBuffers, ChangeDetector *changeDetector = nullptr) : name(std::move(windowName)), capture(videoCapture), detector(changeDetector)
     {
         cv::namedWindow(name, flags);
+        cv::setOpenGlContext(name);
         glEnable(GL_TEXTURE_2D);
         glGenTextures(1, &texture);
+        streamer = std::make_unique<TextureStreamer>(texture, uploadMode, uploadBuffers);
 
         cv::setOpenGlDrawCallback(name, onDraw, this);
     }
 
     ~ImageWindow()
     {
+        cv::setOpenGlContext(name);
+        streamer.reset();
+
         if (!getName().empty())
             cv::destroyWindow(name);
     }
@@ -78,13 +74,50 @@ public:
 
         while (cv::waitKey(30) != 'q')
         {
-            capture >> frame;
-            loadTexture(frame, texture);
-            cv::updateWindow(name);
+            {
+                TRACE_SCOPE("capture.read");
+                capture >> frame;
+            }
+            upload(frame);
+            {
+                TRACE_SCOPE("cv::updateWindow");
+                cv::updateWindow(name);
+            }
             angle += 4;
         }
 
+        const auto &stats = streamer->getStats();
+        std::cout << "Uploaded " << stats.frames << " frames (" << stats.partialFrames << " partial, " << (stats.bytes >> 20) << " MB), avg "
+                  << stats.averageMs() << " ms, max " << stats.maxMs << " ms\n";
+        if (detector)
+            detector->getStats().print(std::cout, stats.averageMs());
+    }
+
+    // Without a change detector every frame is uploaded whole. With one, unchanged frames keep the
+    // texture as it is and partly changed ones only update their dirty blocks; the quad is redrawn either way.
+    void upload(const cv::Mat &frame)
+    {
+        if (!detector)
+        {
+            streamer->upload(frame.data, frame.cols, frame.rows, frame.step);
+            return;
+        }
+
+        if (!detector->detect(frame))
+            return;
 
+        const auto &dirty = detector->getDirty();
+        if (dirty.size() == 1 && dirty.front().size() == frame.size())
+        {
+            streamer->upload(frame.data, frame.cols, frame.rows, frame.step);
+            return;
+        }
+
+        regions.clear();
+        for (const auto &rect: dirty)
+            regions.push_back({rect.x, rect.y, rect.width, rect.height});
+
+        streamer->uploadRegions(frame.data, frame.cols, frame.rows, frame.step, regions);
     }
 
     void show(cv::Mat &img)
@@ -98,16 +131,51 @@ public:
     }
 };
 
-int main()
+int main(int argc, char **argv)
 {
+    const char *keys = {
+            "{help h usage? || print  this message}"
+            "{upload | subimage | Texture upload mode: teximage, subimage or pbo}"
+            "{buffers | 2 | Pixel buffer objects used by the pbo upload mode}"
+            "{skipstatic | | Skip the upload of frames that barely differ from the last uploaded one and upload only the changed blocks of the others}"
+            "{changeblock | 64 | Block side in pixels compared by --skipstatic}"
+            "{changethreshold | 4 | Mean grey level difference over a block that counts as a change}"};
+
+    cv::CommandLineParser parser{argc, argv, keys};
+
+    if (parser.has("help"))
+    {
+        parser.printMessage();
+        return 0;
+    }
+
+    if (!parser.check())
+    {
+        parser.printErrors();
+        return 0;
+    }
+
+    const auto upload = parser.get<cv::String>("upload");
+    auto uploadMode = UploadMode::SubImage;
+    if (upload == "teximage")
+        uploadMode = UploadMode::Reallocate;
+    else if (upload == "pbo")
+        uploadMode = UploadMode::PixelBuffers;
+
     cv::VideoCapture capture;
 
     if (!capture.open(0))
         return -1;
 
-    ImageWindow window{"Camera", capture, cv::WINDOW_OPENGL};
+    std::unique_ptr<ChangeDetector> detector;
+    if (parser.has("skipstatic"))
+        detector = std::make_unique<ChangeDetector>(parser.get<int>("changeblock"), parser.get<double>("changethreshold"));
+
+    ImageWindow window{"Camera", capture, cv::WINDOW_OPENGL, uploadMode, parser.get<int>("buffers"), detector.get()};
 
     window.show();
 
+    TRACE_DUMP("lab6.trace.json");
+
     return 0;
 }
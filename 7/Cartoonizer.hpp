@@ -0,0 +1,127 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stop_token>
+#include <vector>
+
+struct CartoonParams
+{
+    int pyramidLevels = 2;
+    int smoothingPasses = 4;
+    int bilateralDiameter = 9;
+    double sigmaColor = 9;
+    double sigmaSpace = 7;
+    int medianKernel = 7;
+    int edgeBlock = 9;
+    double edgeOffset = 2;
+};
+
+// Flat colour regions with dark outlines. The colour stage runs the edge-preserving bilateral filter
+// on a reduced pyramid level, where a few passes are cheap, and upsamples the result. The outline
+// stage (grey, median, adaptive threshold) and the final combination run over row stripes in
+// parallel, each stripe reading enough extra rows for both neighbourhoods so seams do not show.
+// Intermediate buffers are kept between calls so video frames of a fixed size do not allocate them.
+class Cartoonizer
+{
+    CartoonParams params;
+    std::vector<cv::Mat> pyramid;
+    cv::Mat smoothed;
+    cv::Mat scratch;
+    cv::Mat colour;
+
+    void smoothColours(const cv::Mat &src, const std::stop_token &stopToken)
+    {
+        TRACE_SCOPE("Cartoonizer::smoothColours");
+
+        const auto levels = std::max(0, params.pyramidLevels);
+        pyramid.resize(levels + 1);
+        pyramid[0] = src;
+
+        for (int level = 1; level <= levels; ++level)
+            cv::pyrDown(pyramid[level - 1], pyramid[level]);
+
+        // The first pass reads the top level itself, which is src when there are no levels, so the
+        // passes only ever write into buffers owned here.
+        if (params.smoothingPasses <= 0)
+            pyramid[levels].copyTo(smoothed);
+
+        for (int pass = 0; pass < params.smoothingPasses && !stopToken.stop_requested(); ++pass)
+        {
+            cv::bilateralFilter(pass ? smoothed : pyramid[levels], scratch, params.bilateralDiameter, params.sigmaColor, params.sigmaSpace);
+            std::swap(smoothed, scratch);
+        }
+
+        if (!levels)
+        {
+            smoothed.copyTo(colour);
+            return;
+        }
+
+        for (int level = levels - 1; level > 0; --level)
+        {
+            cv::pyrUp(smoothed, scratch, pyramid[level].size());
+            std::swap(smoothed, scratch);
+        }
+
+        cv::pyrUp(smoothed, colour, src.size());
+    }
+
+public:
+    explicit Cartoonizer(CartoonParams cartoonParams = {}) : params(cartoonParams)
+    {
+    }
+
+    // Returns false when stopped before dst was complete.
+    bool apply(const cv::Mat &src, cv::Mat &dst, const std::stop_token &stopToken = {})
+    {
+        TRACE_SCOPE("Cartoonizer::apply");
+        CV_Assert(src.type() == CV_8UC3);
+
+        smoothColours(src, stopToken);
+        if (stopToken.stop_requested())
+            return false;
+
+        dst.create(src.size(), CV_8UC3);
+
+        const auto halo = params.medianKernel / 2 + params.edgeBlock / 2;
+        const auto stripes = std::max(1, std::min(src.rows / std::max(1, 4 * halo), cv::getNumThreads() * 2));
+
+        cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range &range)
+                          {
+                              TRACE_SCOPE("Cartoonizer::outlineStripes");
+                              cv::Mat grey, median, edges;
+
+                              for (int stripe = range.start; stripe < range.end && !stopToken.stop_requested(); ++stripe)
+                              {
+                                  const auto top = src.rows * stripe / stripes;
+                                  const auto bottom = src.rows * (stripe + 1) / stripes;
+                                  const auto haloTop = std::max(0, top - halo);
+                                  const auto haloBottom = std::min(src.rows, bottom + halo);
+
+                                  cv::cvtColor(src.rowRange(haloTop, haloBottom), grey, cv::COLOR_BGR2GRAY);
+                                  cv::medianBlur(grey, median, params.medianKernel);
+                                  cv::adaptiveThreshold(median, edges, 255, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY, params.edgeBlock, params.edgeOffset);
+
+                                  for (int y = top; y < bottom; ++y)
+                                  {
+                                      const auto *mask = edges.ptr<uchar>(y - haloTop);
+                                      const auto *in = colour.ptr<uchar>(y);
+                                      auto *out = dst.ptr<uchar>(y);
+
+                                      for (int x = 0; x < src.cols; ++x, in += 3, out += 3)
+                                      {
+                                          const auto keep = mask[x];
+                                          out[0] = in[0] & keep;
+                                          out[1] = in[1] & keep;
+                                          out[2] = in[2] & keep;
+                                      }
+                                  }
+                              }
+                          });
+
+        return !stopToken.stop_requested();
+    }
+};
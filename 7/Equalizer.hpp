@@ -0,0 +1,183 @@
+#pragma once
+
+#include "Luminance.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <stop_token>
+#include <vector>
+
+inline std::array<uint32_t, 256> luminanceHistogram(const cv::Mat &image, cv::Rect area)
+{
+    std::array<std::array<uint32_t, 256>, 4> sub{};
+
+    for (int y = area.y; y < area.y + area.height; ++y)
+    {
+        const auto *p = image.ptr<uchar>(y) + area.x * 3;
+        int x = 0;
+
+        for (; x + 4 <= area.width; x += 4, p += 12)
+        {
+            sub[0][luminance(p)]++;
+            sub[1][luminance(p + 3)]++;
+            sub[2][luminance(p + 6)]++;
+            sub[3][luminance(p + 9)]++;
+        }
+
+        for (; x < area.width; ++x, p += 3)
+            sub[0][luminance(p)]++;
+    }
+
+    for (int bin = 0; bin < 256; ++bin)
+        sub[0][bin] += sub[1][bin] + sub[2][bin] + sub[3][bin];
+
+    return sub[0];
+}
+
+// Global histogram equalisation of the luminance of a BGR image: one striped parallel pass to count
+// Y, one parallel pass to remap. No YCrCb image or planes are allocated. Both passes check stopToken
+// once per stripe or row; returns false when stopped before dst was complete.
+inline bool equalizeLuminance(const cv::Mat &src, cv::Mat &dst, const std::stop_token &stopToken = {})
+{
+    TRACE_SCOPE("equalizeLuminance");
+    CV_Assert(src.type() == CV_8UC3);
+
+    const auto stripes = std::max(1, std::min(src.rows / 16, cv::getNumThreads() * 4));
+    std::vector<std::array<uint32_t, 256>> partial(stripes);
+
+    cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range &range)
+                      {
+                          for (int stripe = range.start; stripe < range.end && !stopToken.stop_requested(); ++stripe)
+                          {
+                              const auto top = static_cast<int>(static_cast<int64_t>(src.rows) * stripe / stripes);
+                              const auto bottom = static_cast<int>(static_cast<int64_t>(src.rows) * (stripe + 1) / stripes);
+                              partial[stripe] = luminanceHistogram(src, cv::Rect(0, top, src.cols, bottom - top));
+                          }
+                      });
+
+    std::array<uint32_t, 256> histogram{};
+    for (const auto &stripe: partial)
+        for (int bin = 0; bin < 256; ++bin)
+            histogram[bin] += stripe[bin];
+
+    if (stopToken.stop_requested())
+        return false;
+
+    const auto lut = equalizationLut(histogram);
+
+    dst.create(src.size(), CV_8UC3);
+    cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &range)
+                      {
+                          for (int y = range.start; y < range.end && !stopToken.stop_requested(); ++y)
+                          {
+                              const auto *in = src.ptr<uchar>(y);
+                              auto *out = dst.ptr<uchar>(y);
+
+                              for (int x = 0; x < src.cols; ++x, in += 3, out += 3)
+                              {
+                                  const auto oldY = luminance(in);
+                                  shiftLuminance(in, out, lut[oldY], oldY);
+                              }
+                          }
+                      });
+
+    return !stopToken.stop_requested();
+}
+
+// Contrast limited adaptive equalisation of the luminance, following cv::CLAHE: every tile builds
+// its clipped histogram and mapping in parallel, then each pixel blends the mappings of its four
+// nearest tiles. Stops like equalizeLuminance.
+inline bool equalizeLuminanceClahe(const cv::Mat &src, cv::Mat &dst, double clipLimit = 40., cv::Size tiles = {8, 8}, const std::stop_token &stopToken = {})
+{
+    TRACE_SCOPE("equalizeLuminanceClahe");
+    CV_Assert(src.type() == CV_8UC3 && tiles.width > 0 && tiles.height > 0);
+
+    const cv::Size tileSize{(src.cols + tiles.width - 1) / tiles.width, (src.rows + tiles.height - 1) / tiles.height};
+    std::vector<LuminanceLut> luts(tiles.area());
+
+    cv::parallel_for_(cv::Range(0, tiles.area()), [&](const cv::Range &range)
+                      {
+                          for (int tile = range.start; tile < range.end && !stopToken.stop_requested(); ++tile)
+                          {
+                              const cv::Rect area = cv::Rect(cv::Point((tile % tiles.width) * tileSize.width, (tile / tiles.width) * tileSize.height), tileSize) & cv::Rect(0, 0, src.cols, src.rows);
+                              auto histogram = luminanceHistogram(src, area);
+                              const auto tileArea = std::max(1, area.area());
+
+                              if (clipLimit > 0)
+                              {
+                                  const auto limit = std::max(1u, static_cast<uint32_t>(clipLimit * tileArea / 256));
+                                  uint32_t clipped = 0;
+
+                                  for (auto &count: histogram)
+                                      if (count > limit)
+                                      {
+                                          clipped += count - limit;
+                                          count = limit;
+                                      }
+
+                                  const auto batch = clipped / 256;
+                                  const auto residual = clipped - batch * 256;
+                                  for (auto &count: histogram)
+                                      count += batch;
+
+                                  if (residual)
+                                  {
+                                      const auto step = std::max(1u, 256 / residual);
+                                      for (uint32_t bin = 0, left = residual; bin < 256 && left; bin += step, --left)
+                                          histogram[bin]++;
+                                  }
+                              }
+
+                              const auto scale = 255.f / static_cast<float>(tileArea);
+                              uint64_t sum = 0;
+                              auto &lut = luts[tile];
+
+                              for (int bin = 0; bin < 256; ++bin)
+                              {
+                                  sum += histogram[bin];
+                                  lut[bin] = cv::saturate_cast<uchar>(static_cast<float>(sum) * scale);
+                              }
+                          }
+                      });
+
+    if (stopToken.stop_requested())
+        return false;
+
+    const auto inverseWidth = 1.f / static_cast<float>(tileSize.width);
+    const auto inverseHeight = 1.f / static_cast<float>(tileSize.height);
+
+    dst.create(src.size(), CV_8UC3);
+    cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &range)
+                      {
+                          for (int y = range.start; y < range.end && !stopToken.stop_requested(); ++y)
+                          {
+                              const auto tyf = static_cast<float>(y) * inverseHeight - 0.5f;
+                              const auto ty = cvFloor(tyf);
+                              const auto ya = tyf - static_cast<float>(ty);
+                              const auto *upper = &luts[std::max(ty, 0) * tiles.width];
+                              const auto *lower = &luts[std::min(ty + 1, tiles.height - 1) * tiles.width];
+
+                              const auto *in = src.ptr<uchar>(y);
+                              auto *out = dst.ptr<uchar>(y);
+
+                              for (int x = 0; x < src.cols; ++x, in += 3, out += 3)
+                              {
+                                  const auto txf = static_cast<float>(x) * inverseWidth - 0.5f;
+                                  const auto tx = cvFloor(txf);
+                                  const auto xa = txf - static_cast<float>(tx);
+                                  const auto left = std::max(tx, 0);
+                                  const auto right = std::min(tx + 1, tiles.width - 1);
+
+                                  const auto oldY = luminance(in);
+                                  const auto top = upper[left][oldY] * (1 - xa) + upper[right][oldY] * xa;
+                                  const auto bottom = lower[left][oldY] * (1 - xa) + lower[right][oldY] * xa;
+
+                                  shiftLuminance(in, out, cvRound(top * (1 - ya) + bottom * ya), oldY);
+                              }
+                          }
+                      });
+
+    return !stopToken.stop_requested();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "ChannelHistograms.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <stop_token>
+#include <vector>
+
+// Counts every channel of an interleaved BGR image in one pass. Each stripe of rows fills four
+// interleaved sub-histograms per channel, so neighbouring pixels with the same value do not wait on
+// each other's increment, and the stripes are summed once they are done. With stride > 1 only every
+// stride-th pixel of every stride-th row is counted, which is enough for previews of huge images.
+// Stripes are skipped once stopToken fires, the counts are then incomplete.
+inline ChannelHistograms computeHistograms(const cv::Mat &image, int stride = 1, const std::stop_token &stopToken = {})
+{
+    TRACE_SCOPE("computeHistograms");
+    CV_Assert(image.type() == CV_8UC3 && stride > 0);
+
+    using SubHistograms = std::array<std::array<std::array<uint32_t, 256>, 3>, 4>;
+
+    const auto rows = (image.rows + stride - 1) / stride;
+    const auto samplesPerRow = (image.cols + stride - 1) / stride;
+    const auto stripes = std::max(1, std::min(rows / 16, cv::getNumThreads() * 4));
+    std::vector<SubHistograms> partial(stripes);
+
+    cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range &range)
+                      {
+                          for (int stripe = range.start; stripe < range.end && !stopToken.stop_requested(); ++stripe)
+                          {
+                              auto &sub = partial[stripe];
+                              for (auto &histograms: sub)
+                                  for (auto &histogram: histograms)
+                                      histogram.fill(0);
+
+                              const auto pixelStep = 3 * stride;
+                              const auto end = static_cast<int>(static_cast<int64_t>(rows) * (stripe + 1) / stripes);
+
+                              for (auto row = static_cast<int>(static_cast<int64_t>(rows) * stripe / stripes); row < end; ++row)
+                              {
+                                  const auto *p = image.ptr<uchar>(row * stride);
+                                  int i = 0;
+
+                                  for (; i + 4 <= samplesPerRow; i += 4, p += 4 * pixelStep)
+                                      for (int k = 0; k < 4; ++k)
+                                      {
+                                          const auto *pixel = p + k * pixelStep;
+                                          sub[k][0][pixel[0]]++;
+                                          sub[k][1][pixel[1]]++;
+                                          sub[k][2][pixel[2]]++;
+                                      }
+
+                                  for (; i < samplesPerRow; ++i, p += pixelStep)
+                                  {
+                                      sub[0][0][p[0]]++;
+                                      sub[0][1][p[1]]++;
+                                      sub[0][2][p[2]]++;
+                                  }
+                              }
+                          }
+                      });
+
+    ChannelHistograms result;
+    for (const auto &sub: partial)
+        for (const auto &histograms: sub)
+            for (size_t channel = 0; channel < histograms.size(); ++channel)
+                for (size_t bin = 0; bin < histograms[channel].size(); ++bin)
+                    result.bins[channel][bin] += histograms[channel][bin];
+
+    result.samples = static_cast<uint64_t>(rows) * samplesPerRow;
+
+    return result;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stop_token>
+#include <vector>
+
+enum class MaskPrecision
+{
+    Fixed8,
+    Fixed16
+};
+
+class Lomography
+{
+    static const int maskBaseWidth = 512;
+
+    std::array<uchar, 256> lut{};
+    MaskPrecision precision;
+    cv::Mat halo;
+    cv::Size maskSize;
+
+    static uchar weigh(int value, uchar weight)
+    {
+        const auto x = value * weight + 128;
+        return static_cast<uchar>((x + (x >> 8)) >> 8);
+    }
+
+    static uchar weigh(int value, ushort weight)
+    {
+        return static_cast<uchar>((value * weight + (1 << 14)) >> 15);
+    }
+
+    // Bilinear tap of the small halo for one full-size coordinate, with the pixel-centre alignment of
+    // cv::resize. Coordinates outside the image clamp to the edge.
+    static void tap(int position, int fullSize, int smallSize, int &index, float &fraction)
+    {
+        const auto source = std::clamp((static_cast<float>(position) + 0.5f) * static_cast<float>(smallSize) / static_cast<float>(fullSize) - 0.5f,
+                                       0.f, static_cast<float>(smallSize - 1));
+        index = static_cast<int>(source);
+        fraction = source - static_cast<float>(index);
+    }
+
+    // The halo is a circle blurred by a box a third of the image wide, so it is smooth enough to be
+    // built on a small canvas and interpolated on the fly. Every mask pixel is a function of its
+    // absolute position only, which lets a tile of the image be weighted without the full-size mask.
+    void buildMask(cv::Size size)
+    {
+        TRACE_SCOPE("Lomography::buildMask");
+
+        const auto scale = std::max(1, size.width / maskBaseWidth);
+        const cv::Size small{(size.width + scale - 1) / scale, (size.height + scale - 1) / scale};
+        const auto radius = std::max(1, size.width / 3 / scale);
+
+        cv::Mat canvas{small, CV_32FC1, cv::Scalar{0.3}};
+        cv::circle(canvas, cv::Point{small.width / 2, small.height / 2}, radius, cv::Scalar{1}, -1);
+        cv::blur(canvas, canvas, cv::Size{radius, radius});
+
+        const auto fixedScale = precision == MaskPrecision::Fixed8 ? 255.f : static_cast<float>(1 << 15);
+        canvas *= fixedScale;
+
+        // One replicated row and column so the second bilinear tap never leaves the canvas.
+        cv::copyMakeBorder(canvas, halo, 0, 1, 0, 1, cv::BORDER_REPLICATE);
+        maskSize = size;
+    }
+
+    template<typename T>
+    void fusedPass(const cv::Mat &src, cv::Point origin, cv::Mat &dst, const std::stop_token &stopToken) const
+    {
+        const auto smallSize = cv::Size{halo.cols - 1, halo.rows - 1};
+        std::vector<int> columns(src.cols);
+        std::vector<float> columnFractions(src.cols);
+        for (int x = 0; x < src.cols; ++x)
+            tap(origin.x + x, maskSize.width, smallSize.width, columns[x], columnFractions[x]);
+
+        cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &range)
+                          {
+                              std::vector<float> blended(halo.cols);
+
+                              for (int y = range.start; y < range.end && !stopToken.stop_requested(); ++y)
+                              {
+                                  int row;
+                                  float rowFraction;
+                                  tap(origin.y + y, maskSize.height, smallSize.height, row, rowFraction);
+
+                                  const auto *upper = halo.ptr<float>(row);
+                                  const auto *lower = halo.ptr<float>(row + 1);
+                                  for (int x = 0; x < halo.cols; ++x)
+                                      blended[x] = upper[x] + (lower[x] - upper[x]) * rowFraction;
+
+                                  const auto *in = src.ptr<uchar>(y);
+                                  auto *out = dst.ptr<uchar>(y);
+
+                                  for (int x = 0; x < src.cols; ++x, in += 3, out += 3)
+                                  {
+                                      const auto *pair = &blended[columns[x]];
+                                      const auto weight = static_cast<T>(pair[0] + (pair[1] - pair[0]) * columnFractions[x] + 0.5f);
+                                      out[0] = weigh(in[0], weight);
+                                      out[1] = weigh(in[1], weight);
+                                      out[2] = weigh(lut[in[2]], weight);
+                                  }
+                              }
+                          });
+    }
+
+public:
+    explicit Lomography(MaskPrecision maskPrecision = MaskPrecision::Fixed16) : precision(maskPrecision)
+    {
+        const auto size = static_cast<int>(lut.size());
+        for (int i = 0; i < size; ++i)
+        {
+            auto x = static_cast<double>(i) / size;
+            lut[i] = cv::saturate_cast<uchar>(size / (1 + std::exp(-(x - 0.5) / 0.1)));
+        }
+    }
+
+    // Builds the halo for an image of the given size. apply() calls it on demand; tiled callers call it
+    // once up front so that concurrent tiles only read the shared state.
+    void prepare(cv::Size imageSize)
+    {
+        if (maskSize != imageSize)
+            buildMask(imageSize);
+    }
+
+    // Returns false when stopped before dst was complete.
+    bool apply(const cv::Mat &src, cv::Mat &dst, const std::stop_token &stopToken = {})
+    {
+        prepare(src.size());
+        return apply(src, {0, 0}, dst, stopToken);
+    }
+
+    // Weights src as the region at origin of the image given to prepare(). The pass checks stopToken
+    // once per row and returns false when it fired.
+    bool apply(const cv::Mat &src, cv::Point origin, cv::Mat &dst, const std::stop_token &stopToken = {}) const
+    {
+        TRACE_SCOPE("Lomography::apply");
+        CV_Assert(src.type() == CV_8UC3 && !halo.empty());
+
+        dst.create(src.size(), CV_8UC3);
+
+        if (precision == MaskPrecision::Fixed8)
+            fusedPass<uchar>(src, origin, dst, stopToken);
+        else
+            fusedPass<ushort>(src, origin, dst, stopToken);
+
+        return !stopToken.stop_requested();
+    }
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "Lomography.hpp"
+#include "TiledProcessor.hpp"
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// The vignette is a point operation, it only needs to know where in the image the tile sits.
+// lomography has to be prepared for the full image size before the tiles run.
+inline TileKernel lomographyKernel(const Lomography &lomography)
+{
+    return {"lomo", 0, [&lomography](const cv::Mat &in, cv::Point origin, cv::Mat &out) { lomography.apply(in, origin, out); }};
+}
+
+// Parses a comma separated chain such as "blur:15,sobel,lomo", run in the given order. A blur without
+// a size uses 5. Returns false on an unknown effect.
+inline bool parseEffects(const std::string &spec, const Lomography &lomography, std::vector<TileKernel> &chain)
+{
+    std::stringstream stream{spec};
+    std::string effect;
+
+    while (std::getline(stream, effect, ','))
+    {
+        std::transform(effect.begin(), effect.end(), effect.begin(), [](unsigned char c) { return std::tolower(c); });
+
+        const auto separator = effect.find(':');
+        const auto name = effect.substr(0, separator);
+        const auto argument = separator == std::string::npos ? 0 : std::atoi(effect.c_str() + separator + 1);
+
+        if (name == "blur")
+            chain.push_back(boxBlurKernel(argument > 0 ? argument : 5));
+        else if (name == "sobel")
+            chain.push_back(sobelKernel());
+        else if (name == "lomo")
+            chain.push_back(lomographyKernel(lomography));
+        else if (!name.empty())
+            return false;
+    }
+
+    return !chain.empty();
+}
@@ -0,0 +1,513 @@
+#include "Annotation.hpp"
+#include "Bench.hpp"
+#include "Cartoonizer.hpp"
+#include "Equalizer.hpp"
+#include "Histogram.hpp"
+#include "IntegralBlur.hpp"
+#include "Lomography.hpp"
+#include "PoolAllocator.hpp"
+#include "PreviewProxy.hpp"
+#include "TiledEffects.hpp"
+#include <iostream>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <sys/resource.h>
+
+static const int maxColumns = 256;
+
+// The lomo() implementation this lab shipped with, kept as the baseline.
+static cv::Mat lomoReference(const cv::Mat &image)
+{
+    cv::Mat result;
+
+    const double exp_e = std::exp(1.);
+
+    cv::Mat lut(1, maxColumns, CV_8UC1);
+
+    for (int i = 0; i < maxColumns; ++i)
+    {
+        auto x = static_cast<float>(i) / maxColumns;
+        lut.at<uchar>(i) = cvRound(maxColumns * (1 / (1 + std::pow(exp_e, -(x - 0.5) / 0.1))));
+    }
+
+    std::vector<cv::Mat> channels;
+    cv::split(image, channels);
+    cv::LUT(channels[2], lut, channels[2]);
+
+    cv::merge(channels, result);
+
+    const auto cols = image.cols;
+    const auto rows = image.rows;
+    cv::Mat halo{rows, cols, CV_32FC3, cv::Scalar{0.3, 0.3, 0.3}};
+
+    cv::circle(halo, cv::Point{cols / 2, rows / 2}, cols / 3, cv::Scalar{1, 1, 1}, -1);
+    cv::blur(halo, halo, cv::Size{cols / 3, cols / 3});
+    cv::Mat resultf;
+
+    result.convertTo(resultf, CV_32FC3);
+
+    cv::multiply(resultf, halo, resultf);
+
+    resultf.convertTo(result, CV_8UC3);
+
+    return result;
+}
+
+static cv::Mat syntheticImage(cv::Size size)
+{
+    cv::Mat image{size, CV_8UC3};
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+
+    return image;
+}
+
+static void benchLomo(int iterations)
+{
+    const std::array<cv::Size, 3> sizes = {cv::Size{1920, 1080}, cv::Size{4000, 3000}, cv::Size{6000, 4000}};
+
+    for (const auto size: sizes)
+    {
+        const auto image = syntheticImage(size);
+        const auto suffix = ' ' + std::to_string(size.width) + 'x' + std::to_string(size.height);
+
+        cv::Mat reference, fused;
+        printResult(measure("lomo reference" + suffix, iterations, [&]() { reference = lomoReference(image); }));
+
+        for (const auto precision: {MaskPrecision::Fixed16, MaskPrecision::Fixed8})
+        {
+            Lomography lomography{precision};
+            const auto name = std::string{precision == MaskPrecision::Fixed8 ? "lomo q8 cold" : "lomo q16 cold"} + suffix;
+            printResult(measure(name, 1, [&]() { lomography.apply(image, fused); }));
+
+            const auto warmName = std::string{precision == MaskPrecision::Fixed8 ? "lomo q8 cached" : "lomo q16 cached"} + suffix;
+            printResult(measure(warmName, iterations, [&]() { lomography.apply(image, fused); }));
+
+            std::cout << "    max abs diff vs reference: " << cv::norm(reference, fused, cv::NORM_INF) << '\n';
+        }
+    }
+}
+
+// The split/calcHist/765-line showHistogram() this lab shipped with, kept as the baseline.
+static cv::Mat histogramReference(const cv::Mat &image)
+{
+    std::vector<cv::Mat> bgrPlanes;
+
+    cv::split(image, bgrPlanes);
+
+    int bins = maxColumns;
+    const std::array<float, 2> range = {0, maxColumns};
+    const float *histRange = {range.data()};
+    cv::Mat blueHistogram, greenHistogram, redHistogram;
+
+    cv::calcHist(&bgrPlanes[0], 1, nullptr, cv::Mat(), blueHistogram, 1, &bins, &histRange);
+    cv::calcHist(&bgrPlanes[1], 1, nullptr, cv::Mat(), greenHistogram, 1, &bins, &histRange);
+    cv::calcHist(&bgrPlanes[2], 1, nullptr, cv::Mat(), redHistogram, 1, &bins, &histRange);
+
+    int width = 512;
+    int height = 300;
+
+    cv::Mat histImage(height, width, CV_8UC3, cv::Scalar(20, 20, 20));
+
+    cv::normalize(blueHistogram, blueHistogram, 0, height, cv::NORM_MINMAX);
+    cv::normalize(greenHistogram, greenHistogram, 0, height, cv::NORM_MINMAX);
+    cv::normalize(redHistogram, redHistogram, 0, height, cv::NORM_MINMAX);
+
+    auto binWidth = cvRound(static_cast<float>(width) / static_cast<float>(bins));
+    for (int i = 1; i < bins; ++i)
+    {
+        cv::line(histImage, cv::Point(binWidth * (i - 1), height - cvRound(blueHistogram.at<float>(i - 1))),
+                 cv::Point(binWidth * (i), height - cvRound(blueHistogram.at<float>(i))),
+                 cv::Scalar(255, 0, 0), 2, 8, 0);
+        cv::line(histImage, cv::Point(binWidth * (i - 1), height - cvRound(greenHistogram.at<float>(i - 1))),
+                 cv::Point(binWidth * (i), height - cvRound(greenHistogram.at<float>(i))),
+                 cv::Scalar(0, 255, 0), 2, 8, 0);
+        cv::line(histImage, cv::Point(binWidth * (i - 1), height - cvRound(redHistogram.at<float>(i - 1))),
+                 cv::Point(binWidth * (i), height - cvRound(redHistogram.at<float>(i))),
+                 cv::Scalar(0, 0, 255), 2, 8, 0);
+    }
+
+    return histImage;
+}
+
+static void benchHistogram(int iterations)
+{
+    const std::array<cv::Size, 3> sizes = {cv::Size{1920, 1080}, cv::Size{4000, 3000}, cv::Size{6000, 4000}};
+
+    for (const auto size: sizes)
+    {
+        const auto image = syntheticImage(size);
+        const auto suffix = ' ' + std::to_string(size.width) + 'x' + std::to_string(size.height);
+
+        cv::Mat reference, canvas;
+        printResult(measure("histogram reference" + suffix, iterations, [&]() { reference = histogramReference(image); }));
+
+        for (const auto stride: {1, 4})
+        {
+            ChannelHistograms histograms;
+            printResult(measure("histogram stride " + std::to_string(stride) + suffix, iterations, [&]()
+                                {
+                                    histograms = computeHistograms(image, stride);
+                                    renderHistograms(histograms, canvas);
+                                }));
+        }
+
+        // The exact pass has to agree bin for bin with cv::calcHist.
+        std::vector<cv::Mat> planes;
+        cv::split(image, planes);
+        const auto histograms = computeHistograms(image);
+        int bins = maxColumns;
+        const std::array<float, 2> range = {0, maxColumns};
+        const float *histRange = {range.data()};
+        double worst = 0;
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            cv::Mat expected;
+            cv::calcHist(&planes[channel], 1, nullptr, cv::Mat(), expected, 1, &bins, &histRange);
+            for (int bin = 0; bin < bins; ++bin)
+                worst = std::max(worst, std::abs(expected.at<float>(bin) - static_cast<double>(histograms.bins[channel][bin])));
+        }
+        std::cout << "    max bin diff vs calcHist: " << worst << '\n';
+    }
+}
+
+// The YCrCb round trip equalizeImage() shipped with, kept as the baseline.
+static cv::Mat equalizeReference(const cv::Mat &image)
+{
+    cv::Mat result, ycrcb;
+    cv::cvtColor(image, ycrcb, cv::COLOR_BGR2YCrCb);
+    std::vector<cv::Mat> channels;
+    cv::split(ycrcb, channels);
+    cv::equalizeHist(channels[0], channels[0]);
+    cv::merge(channels, ycrcb);
+    cv::cvtColor(ycrcb, result, cv::COLOR_YCrCb2BGR);
+
+    return result;
+}
+
+static cv::Mat claheReference(const cv::Mat &image)
+{
+    cv::Mat result, ycrcb;
+    cv::cvtColor(image, ycrcb, cv::COLOR_BGR2YCrCb);
+    std::vector<cv::Mat> channels;
+    cv::split(ycrcb, channels);
+    cv::createCLAHE()->apply(channels[0], channels[0]);
+    cv::merge(channels, ycrcb);
+    cv::cvtColor(ycrcb, result, cv::COLOR_YCrCb2BGR);
+
+    return result;
+}
+
+static void benchEqualize(int iterations)
+{
+    const std::array<cv::Size, 3> sizes = {cv::Size{1920, 1080}, cv::Size{4000, 3000}, cv::Size{6000, 4000}};
+
+    for (const auto size: sizes)
+    {
+        // Uniform noise is already flat, a gradient gives the equaliser something to do.
+        auto image = syntheticImage(size);
+        cv::Mat ramp{size, CV_8UC3};
+        for (int y = 0; y < size.height; ++y)
+            ramp.row(y).setTo(cv::Scalar::all(64 + 64 * y / size.height));
+        cv::addWeighted(image, 0.25, ramp, 0.75, 0, image);
+
+        const auto suffix = ' ' + std::to_string(size.width) + 'x' + std::to_string(size.height);
+
+        cv::Mat reference, fused, adaptiveReference, adaptive;
+        printResult(measure("equalize reference" + suffix, iterations, [&]() { reference = equalizeReference(image); }));
+        printResult(measure("equalize fused" + suffix, iterations, [&]() { equalizeLuminance(image, fused); }));
+        std::cout << "    max abs diff vs reference: " << cv::norm(reference, fused, cv::NORM_INF) << '\n';
+
+        printResult(measure("clahe reference" + suffix, iterations, [&]() { adaptiveReference = claheReference(image); }));
+        printResult(measure("clahe fused" + suffix, iterations, [&]() { equalizeLuminanceClahe(image, adaptive); }));
+        std::cout << "    max abs diff vs reference: " << cv::norm(adaptiveReference, adaptive, cv::NORM_INF) << '\n';
+    }
+}
+
+// The cartoon pipeline has to sustain 30 fps on 1080p video, so it is measured against that budget.
+static void benchCartoon(int iterations)
+{
+    const double budgetMs = 1000. / 30;
+    const std::array<cv::Size, 3> sizes = {cv::Size{1280, 720}, cv::Size{1920, 1080}, cv::Size{3840, 2160}};
+
+    for (const auto size: sizes)
+    {
+        auto image = syntheticImage(size);
+        cv::GaussianBlur(image, image, cv::Size(0, 0), 3);
+        const auto suffix = ' ' + std::to_string(size.width) + 'x' + std::to_string(size.height);
+
+        Cartoonizer cartoonizer;
+        cv::Mat result;
+        cartoonizer.apply(image, result);
+
+        const auto measured = measure("cartoon" + suffix, std::max(iterations, 30), [&]() { cartoonizer.apply(image, result); });
+        printResult(measured);
+        std::cout << "    " << 1000. / measured.p99Ms << " fps at p99, " << (measured.p99Ms <= budgetMs ? "within" : "over")
+                  << " the " << budgetMs << " ms frame budget\n";
+    }
+}
+
+// Emulates a slider drag: one blur per kernel size, from 1 to maxKernel, on the same image.
+static void benchBlur(int iterations)
+{
+    const int maxKernel = 100;
+    const auto image = syntheticImage(cv::Size{4000, 3000});
+
+    IntegralBlur integralBlur{maxKernel};
+    printResult(measure("integral table build 4000x3000", iterations, [&]()
+                        {
+                            integralBlur.invalidate();
+                            integralBlur.rebuild(image);
+                        }));
+
+    double boxTotal = 0;
+    double integralTotal = 0;
+    double worstDiff = 0;
+
+    for (int ksize = 1; ksize <= maxKernel; ++ksize)
+    {
+        cv::Mat box, integral;
+        const auto boxResult = measure("cv::blur k=" + std::to_string(ksize), iterations, [&]() { cv::blur(image, box, cv::Size(ksize, ksize)); });
+        const auto integralResult = measure("integral k=" + std::to_string(ksize), iterations, [&]() { integralBlur.apply(image, ksize, integral); });
+        const auto diff = cv::norm(box, integral, cv::NORM_INF);
+
+        boxTotal += boxResult.medianMs;
+        integralTotal += integralResult.medianMs;
+        worstDiff = std::max(worstDiff, diff);
+
+        if (ksize == 1 || ksize % 10 == 0)
+        {
+            printResult(boxResult);
+            printResult(integralResult);
+            std::cout << "    max abs diff: " << diff << '\n';
+        }
+    }
+
+    std::cout << "slider sweep 1.." << maxKernel << ": cv::blur " << boxTotal << " ms, integral " << integralTotal
+              << " ms, worst abs diff " << worstDiff << '\n';
+}
+
+// A click on a blurred 50 MP image: the full re-render onMouse used to do against the dirty-rectangle
+// update. Both start from the same annotated image, and the updated result has to match the full one.
+static void benchClick(int iterations)
+{
+    const int maxKernel = 100;
+    const auto image = syntheticImage(cv::Size{8192, 6144});
+    const std::array<cv::Point, 4> clicks = {cv::Point{4000, 3000}, cv::Point{3, 3}, cv::Point{8190, 6000}, cv::Point{100, 6143}};
+
+    for (const auto ksize: {5, 31, 100})
+    {
+        auto annotated = image.clone();
+        IntegralBlur fullBlur{maxKernel};
+        IntegralBlur dirtyBlur{maxKernel};
+        cv::Mat full, incremental;
+        fullBlur.apply(annotated, ksize, full);
+        dirtyBlur.apply(annotated, ksize, incremental);
+
+        size_t click = 0;
+        const auto suffix = " k=" + std::to_string(ksize) + " 8192x6144";
+        printResult(measure("click full" + suffix, iterations, [&]()
+                            {
+                                drawAnnotation(annotated, clicks[click++ % clicks.size()]);
+                                fullBlur.invalidate();
+                                fullBlur.apply(annotated, ksize, full);
+                            }));
+
+        annotated = image.clone();
+        dirtyBlur.apply(annotated, ksize, incremental);
+        click = 0;
+        printResult(measure("click dirty" + suffix, iterations, [&]()
+                            {
+                                const auto changed = drawAnnotation(annotated, clicks[click++ % clicks.size()]);
+                                dirtyBlur.update(annotated, ksize, changed, incremental);
+                            }));
+
+        std::cout << "    max abs diff vs full re-render: " << cv::norm(full, incremental, cv::NORM_INF) << '\n';
+    }
+}
+
+// What a progressive window shows first on a 50 MP image against the full resolution result it later
+// swaps in. A click only carries the change down the pyramid, which has to match a fresh build.
+static void benchPreview(int iterations)
+{
+    const auto image = syntheticImage(cv::Size{8192, 6144});
+    const auto suffix = std::string{" 8192x6144"};
+
+    PreviewProxy proxy{1024};
+    printResult(measure("proxy build" + suffix, iterations, [&]() { proxy.build(image); }));
+
+    auto annotated = image.clone();
+    proxy.build(annotated);
+    const std::array<cv::Point, 4> clicks = {cv::Point{4000, 3000}, cv::Point{3, 3}, cv::Point{8190, 6000}, cv::Point{100, 6143}};
+    size_t click = 0;
+    printResult(measure("proxy click update" + suffix, iterations, [&]() { proxy.update(annotated, drawAnnotation(annotated, clicks[click++ % clicks.size()])); }));
+
+    PreviewProxy fresh{1024};
+    fresh.build(annotated);
+    std::cout << "    max abs diff vs fresh build: " << cv::norm(proxy.get(), fresh.get(), cv::NORM_INF) << '\n';
+
+    cv::Mat preview, shown, full;
+    const int ksize = 31;
+    IntegralBlur integralBlur{100};
+    integralBlur.rebuild(image);
+    proxy.build(image);
+    printResult(measure("preview blur k=31" + suffix, iterations, [&]()
+                        {
+                            const auto scaled = proxy.scaleKernel(ksize);
+                            cv::blur(proxy.get(), preview, cv::Size(scaled, scaled));
+                            proxy.upscale(preview, shown);
+                        }));
+    printResult(measure("full blur k=31" + suffix, iterations, [&]() { integralBlur.apply(image, ksize, full); }));
+
+    Lomography previewLomography, lomography;
+    printResult(measure("preview lomo" + suffix, iterations, [&]()
+                        {
+                            previewLomography.apply(proxy.get(), preview);
+                            proxy.upscale(preview, shown);
+                        }));
+    printResult(measure("full lomo" + suffix, iterations, [&]() { lomography.apply(image, full); }));
+
+    Cartoonizer previewCartoonizer, cartoonizer;
+    printResult(measure("preview cartoon" + suffix, iterations, [&]()
+                        {
+                            previewCartoonizer.apply(proxy.get(), preview);
+                            proxy.upscale(preview, shown);
+                        }));
+    printResult(measure("full cartoon" + suffix, std::max(1, iterations / 5), [&]() { cartoonizer.apply(image, full); }));
+}
+
+static long minorPageFaults()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_minflt;
+}
+
+// The window effects the way a click runs them, every result buffer new, first with the system
+// allocator and then with the buffer pool as the default allocator.
+static void benchPool(int iterations)
+{
+    const auto image = syntheticImage(cv::Size{4000, 3000});
+    PoolAllocator pool{512 << 20};
+    Lomography lomography;
+    Cartoonizer cartoonizer;
+
+    const auto effects = [&]()
+    {
+        cv::Mat blurred, equalized, lomo, cartoon;
+        cv::blur(image, blurred, cv::Size(15, 15));
+        equalizeLuminance(image, equalized);
+        lomography.apply(image, lomo);
+        cartoonizer.apply(image, cartoon);
+    };
+
+    for (const auto pooled: {false, true})
+    {
+        if (pooled)
+            cv::Mat::setDefaultAllocator(&pool);
+
+        effects();
+        const auto before = pool.getStats();
+        const auto faults = minorPageFaults();
+
+        const auto result = measure(pooled ? "effects pooled 4000x3000" : "effects system 4000x3000", iterations, effects);
+        const auto after = pool.getStats();
+
+        printResult(result);
+        std::cout << "    " << (minorPageFaults() - faults) / iterations << " page faults per iteration";
+        if (pooled)
+            std::cout << ", " << static_cast<double>(after.systemAllocations - before.systemAllocations) / iterations << " pool misses per iteration";
+        std::cout << '\n';
+    }
+
+    pool.getStats().print(std::cout);
+    cv::Mat::setDefaultAllocator(&benchAllocator());
+}
+
+// The tiled chain has to reproduce the whole-image chain exactly, with tile buffers held to the budget.
+static void benchTiled(int iterations)
+{
+    const size_t budget = 64 << 20;
+    const std::array<cv::Size, 2> sizes = {cv::Size{4000, 3000}, cv::Size{12000, 8000}};
+
+    for (const auto size: sizes)
+    {
+        const auto image = syntheticImage(size);
+        const auto suffix = ' ' + std::to_string(size.width) + 'x' + std::to_string(size.height);
+
+        Lomography lomography;
+        lomography.prepare(size);
+        std::vector<TileKernel> chain;
+        parseEffects("blur:15,sobel,lomo", lomography, chain);
+
+        cv::Mat blurred, edges, whole, tiled;
+        printResult(measure("whole blur+sobel+lomo" + suffix, iterations, [&]()
+                            {
+                                cv::blur(image, blurred, cv::Size(15, 15));
+                                cv::Sobel(blurred, edges, CV_8U, 1, 1);
+                                lomography.apply(edges, {0, 0}, whole);
+                            }));
+
+        const TiledProcessor processor{chain, budget};
+        TileStats stats;
+        printResult(measure("tiled blur+sobel+lomo" + suffix, iterations, [&]() { stats = processor.process(image, tiled); }));
+        stats.print(std::cout);
+        std::cout << "    max abs diff vs whole image: " << cv::norm(whole, tiled, cv::NORM_INF) << '\n';
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *keys = {
+            "{help h usage? || print  this message}"
+            "{kernel | all | Kernel to benchmark: all, lomo, blur, histogram, equalize, cartoon, tiled, click, preview, pool}"
+            "{iterations | 10 | Timed iterations per case}"};
+
+    cv::CommandLineParser parser{argc, argv, keys};
+
+    if (parser.has("help"))
+    {
+        parser.printMessage();
+        return 0;
+    }
+
+    if (!parser.check())
+    {
+        parser.printErrors();
+        return 0;
+    }
+
+    const auto kernel = parser.get<std::string>("kernel");
+    const auto iterations = std::max(1, parser.get<int>("iterations"));
+
+    benchAllocator();
+
+    if (kernel == "all" || kernel == "lomo")
+        benchLomo(iterations);
+
+    if (kernel == "all" || kernel == "blur")
+        benchBlur(iterations);
+
+    if (kernel == "all" || kernel == "histogram")
+        benchHistogram(iterations);
+
+    if (kernel == "all" || kernel == "equalize")
+        benchEqualize(iterations);
+
+    if (kernel == "all" || kernel == "cartoon")
+        benchCartoon(iterations);
+
+    if (kernel == "all" || kernel == "tiled")
+        benchTiled(iterations);
+
+    if (kernel == "all" || kernel == "click")
+        benchClick(iterations);
+
+    if (kernel == "all" || kernel == "preview")
+        benchPreview(iterations);
+
+    if (kernel == "all" || kernel == "pool")
+        benchPool(iterations);
+
+    return 0;
+}
@@ -1,9 +1,22 @@
+#include "Lomography.hpp"
+#include "Cartoonizer.hpp"
+#include "Equalizer.hpp"
+#include "Histogram.hpp"
+#include "Annotation.hpp"
+#include "IntegralBlur.hpp"
+#include "JobRunner.hpp"
+#include "PoolAllocator.hpp"
+#include "PreviewProxy.hpp"
+#include "ResultCache.hpp"
+#include "TiledEffects.hpp"
 #include <filesystem>
 #include <iostream>
+#include <mutex>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/videoio.hpp>
 #include <utility>
+#include <vector>
 
 enum class ActionType
 {
@@ -14,12 +27,33 @@ enum class ActionType
 };
 
 static const int count = 100;
-static const int maxColumns = 256;
 class ImageWindow
 {
     std::string name;
+    JobRunner &jobs;
+    ResultCache &results;
+
+    // Written by the callbacks, consumed by the next render job.
+    std::mutex requestMutex;
+    int requestedValue = 0;
+    std::vector<cv::Point> clicks;
+
+    // Only touched by the jobs, which never overlap for one window.
+    int value = 0;
+    cv::Rect changed;
     cv::Mat image;
+    cv::Mat blurred;
     int filterValue = 0;
+    IntegralBlur boxBlur{count};
+    int histogramStride = 1;
+    bool adaptiveEqualizer = false;
+    Lomography lomography;
+    Cartoonizer cartoonizer;
+    PreviewProxy proxy;
+    Lomography previewLomography;
+    Cartoonizer previewCartoonizer;
+    uint64_t sourceHash = 0;
+    bool annotated = false;
 
     static void onTrackbar(int pos, void *userdata)
     {
@@ -36,13 +70,7 @@ class ImageWindow
             return;
 
         auto window = static_cast<ImageWindow *>(userInput);
-        cv::circle(window->image, cv::Point(x, y), 10, cv::Scalar(0, 255, 0), 3);
-
-
-        if (window->filterValue)
-            window->applyBasicFilterValue(window->filterValue);
-        else
-            window->show();
+        window->annotate(cv::Point(x, y));
     };
 
     template<ActionType T>
@@ -52,123 +80,224 @@ class ImageWindow
         window->action(T);
     };
 
+    // Every action shows in its own window, so a new request only supersedes the same action.
     void action(ActionType actionType)
     {
+        JobRunner::Job preview;
+        if (proxy.enabled() && actionType == ActionType::Lomo)
+            preview = [this](const std::stop_token &) { return previewLomo(); };
+        else if (proxy.enabled() && actionType == ActionType::Cartoon)
+            preview = [this](const std::stop_token &stopToken) { return previewCartoon(stopToken); };
+
+        jobs.submit(this, "action " + std::to_string(static_cast<int>(actionType)), [this, actionType](const std::stop_token &stopToken) -> JobRunner::Present
+                    {
+                        switch (actionType)
+                        {
+                            case ActionType::Histogram:
+                                return showHistogram(stopToken);
+                            case ActionType::Equalizer:
+                                return equalizeImage(stopToken);
+                            case ActionType::Lomo:
+                                return lomo(stopToken);
+                            case ActionType::Cartoon:
+                                return cartoon(stopToken);
+                        }
+
+                        return {};
+                    },
+                    std::move(preview));
+    }
 
-        switch (actionType)
-        {
-
-            case ActionType::Histogram:
-                showHistogram();
-                break;
-            case ActionType::Equalizer:
-                equalizeImage();
-                break;
-            case ActionType::Lomo:
-                lomo();
-                break;
-            case ActionType::Cartoon:
-                break;
-        }
+    JobRunner::Present showIn(const std::string &title, const cv::Mat &result) const
+    {
+        return [window = name + ' ' + title, result]() { cv::imshow(window, result); };
     }
 
-    void showHistogram()
+    JobRunner::Present showPreviewIn(const std::string &title, const cv::Mat &preview) const
     {
-        std::vector<cv::Mat> bgrPlanes;
+        cv::Mat shown;
+        proxy.upscale(preview, shown);
 
-        cv::split(image, bgrPlanes);
+        return showIn(title, shown);
+    }
 
-        int bins = maxColumns;
-        const std::array<float, 2> range = {0, maxColumns};
-        const float *histRange = {range.data()};
-        cv::Mat blueHistogram, greenHistogram, redHistogram;
+    JobRunner::Present showHistogram(const std::stop_token &stopToken)
+    {
+        TRACE_SCOPE("ImageWindow::showHistogram");
+        const auto histograms = computeHistograms(image, histogramStride, stopToken);
+        if (stopToken.stop_requested())
+            return {};
 
-        cv::Mat mat;
-        cv::calcHist(&bgrPlanes[0], 1, nullptr, cv::Mat(), blueHistogram, 1, &bins, &histRange);
-        cv::calcHist(&bgrPlanes[1], 1, nullptr, cv::Mat(), greenHistogram, 1, &bins, &histRange);
-        cv::calcHist(&bgrPlanes[2], 1, nullptr, cv::Mat(), redHistogram, 1, &bins, &histRange);
+        cv::Mat histImage;
+        renderHistograms(histograms, histImage);
 
-        int width = 512;
-        int height = 300;
+        return showIn("Histogram", histImage);
+    }
 
-        cv::Mat histImage(height, width, CV_8UC3, cv::Scalar(20, 20, 20));
+    // Loads the result of operation from the result cache or computes and stores it. Only the image as
+    // opened is cached, annotated states are one-offs. compute returns false when it was stopped.
+    template<typename F>
+    bool cachedResult(const std::string &operation, cv::Mat &result, F &&compute)
+    {
+        if (!results.enabled() || annotated)
+            return compute(result);
 
-        cv::normalize(blueHistogram, blueHistogram, 0, height, cv::NORM_MINMAX);
-        cv::normalize(greenHistogram, greenHistogram, 0, height, cv::NORM_MINMAX);
-        cv::normalize(redHistogram, redHistogram, 0, height, cv::NORM_MINMAX);
+        const auto key = ResultCache::key(sourceHash, operation);
+        if (results.load(key, result))
+            return true;
 
-        auto binWidth = cvRound(static_cast<float>(width) / static_cast<float>(bins));
-        for (int i = 1; i < bins; ++i)
-        {
-            cv::line(histImage, cv::Point(binWidth * (i - 1), height - cvRound(blueHistogram.at<float>(i - 1))),
-                     cv::Point(binWidth * (i), height - cvRound(blueHistogram.at<float>(i))),
-                     cv::Scalar(255, 0, 0), 2, 8, 0);
-            cv::line(histImage, cv::Point(binWidth * (i - 1), height - cvRound(greenHistogram.at<float>(i - 1))),
-                     cv::Point(binWidth * (i), height - cvRound(greenHistogram.at<float>(i))),
-                     cv::Scalar(0, 255, 0), 2, 8, 0);
-            cv::line(histImage, cv::Point(binWidth * (i - 1), height - cvRound(redHistogram.at<float>(i - 1))),
-                     cv::Point(binWidth * (i), height - cvRound(redHistogram.at<float>(i))),
-                     cv::Scalar(0, 0, 255), 2, 8, 0);
-        }
+        if (!compute(result))
+            return false;
 
-        cv::imshow(name + ' ' + "Histogram", histImage);
+        results.store(key, result);
+        return true;
     }
 
-    void equalizeImage()
+    JobRunner::Present equalizeImage(const std::stop_token &stopToken)
     {
-        cv::Mat result, ycrcb;
-        cv::cvtColor(image, ycrcb, cv::COLOR_BGR2YCrCb);
-        std::vector<cv::Mat> channels;
-        cv::split(ycrcb, channels);
-        cv::equalizeHist(channels[0], channels[0]);
-        cv::merge(channels, ycrcb);
-        cv::cvtColor(ycrcb, result, cv::COLOR_YCrCb2BGR);
+        TRACE_SCOPE("ImageWindow::equalizeImage");
+        cv::Mat result;
+
+        if (!cachedResult(adaptiveEqualizer ? "equalize clahe" : "equalize global", result, [&](cv::Mat &out)
+                          {
+                              return adaptiveEqualizer ? equalizeLuminanceClahe(image, out, 40., {8, 8}, stopToken) : equalizeLuminance(image, out, stopToken);
+                          }))
+            return {};
 
-        cv::imshow(name + ' ' + "Equalized", result);
+        return showIn("Equalized", result);
     }
 
-    void lomo()
+    JobRunner::Present lomo(const std::stop_token &stopToken)
     {
+        TRACE_SCOPE("ImageWindow::lomo");
         cv::Mat result;
+        if (!cachedResult("lomo q16", result, [&](cv::Mat &out) { return lomography.apply(image, out, stopToken); }))
+            return {};
 
-        const double exp_e = std::exp(1.);
+        return showIn("Lomography", result);
+    }
 
-        cv::Mat lut(1, maxColumns, CV_8UC1);// 1, 256, CV_8UC1};
+    JobRunner::Present previewLomo()
+    {
+        TRACE_SCOPE("ImageWindow::previewLomo");
+        cv::Mat preview;
+        previewLomography.apply(proxy.get(), preview);
 
+        return showPreviewIn("Lomography", preview);
+    }
 
-        for (int i = 0; i < maxColumns; ++i)
+    JobRunner::Present previewCartoon(const std::stop_token &stopToken)
+    {
+        TRACE_SCOPE("ImageWindow::previewCartoon");
+        cv::Mat preview;
+        if (!previewCartoonizer.apply(proxy.get(), preview, stopToken))
+            return {};
+
+        return showPreviewIn("Cartoon", preview);
+    }
+
+    JobRunner::Present cartoon(const std::stop_token &stopToken)
+    {
+        TRACE_SCOPE("ImageWindow::cartoon");
+        cv::Mat result;
+        if (!cachedResult("cartoon", result, [&](cv::Mat &out) { return cartoonizer.apply(image, out, stopToken); }))
+            return {};
+
+        return showIn("Cartoon", result);
+    }
+
+    void requestRender()
+    {
+        if (proxy.enabled())
+            jobs.submit(this, "view", [this](const std::stop_token &stopToken) { return render(stopToken); }, [this](const std::stop_token &)
+                        {
+                            takeRequests();
+                            return renderPreview();
+                        });
+        else
+            jobs.submit(this, "view", [this](const std::stop_token &stopToken)
+                        {
+                            takeRequests();
+                            return render(stopToken);
+                        });
+    }
+
+    // Moves the latest request into the job state and draws the new annotations. The changed area adds
+    // up until a full resolution render has taken it into account.
+    void takeRequests()
+    {
+        std::vector<cv::Point> points;
         {
-            auto x = static_cast<float>(i) / maxColumns;
-            lut.at<uchar>(i) = cvRound(maxColumns * (1 / (1 + std::pow(exp_e, -(x - 0.5) / 0.1))));
+            std::lock_guard lock{requestMutex};
+            value = requestedValue;
+            points.swap(clicks);
         }
 
-        std::vector<cv::Mat> channels;
-        cv::split(image, channels);
-        cv::LUT(channels[2], lut, channels[2]);
+        cv::Rect drawn;
+        for (const auto &point: points)
+            drawn |= drawAnnotation(image, point);
 
-        cv::merge(channels, result);
+        if (drawn.empty())
+            return;
 
-        const auto cols = image.cols;
-        const auto rows = image.rows;
-        cv::Mat halo{rows, cols, CV_32FC3, cv::Scalar{0.3, 0.3, 0.3}};
+        changed |= drawn;
+        annotated = true;
+        if (proxy.enabled())
+            proxy.update(image, drawn);
+    }
 
-        cv::circle(halo, cv::Point{cols / 2, rows / 2}, cols / 3, cv::Scalar{1, 1, 1}, -1);
-        cv::blur(halo, halo, cv::Size{cols / 3, cols / 3});
-        cv::Mat resultf;
+    // The blur computed on the proxy and scaled back up, as a stand-in until render() is done.
+    JobRunner::Present renderPreview()
+    {
+        TRACE_SCOPE("ImageWindow::renderPreview");
+        if (!value)
+            return {};
 
-        result.convertTo(resultf, CV_32FC3);
+        cv::Mat preview;
+        const auto ksize = proxy.scaleKernel(value);
+        cv::blur(proxy.get(), preview, cv::Size(ksize, ksize));
 
-        cv::multiply(resultf, halo, resultf);
+        cv::Mat shown;
+        proxy.upscale(preview, shown);
 
-        resultf.convertTo(result, CV_8UC3);
+        return [name = name, shown]() { cv::imshow(name, shown); };
+    }
 
-        cv::imshow(name + ' ' + "Lomography", result);
+    // Brings the view up to the latest request. Clicks only re-blur around the new annotations while the
+    // kernel stays the same; a stopped blur leaves blurred incomplete, so the next render starts over.
+    JobRunner::Present render(const std::stop_token &stopToken)
+    {
+        TRACE_SCOPE("ImageWindow::render");
+
+        const auto region = std::exchange(changed, cv::Rect{});
+        const auto incremental = value && value == filterValue && !region.empty();
+        if (!region.empty() && !incremental)
+        {
+            boxBlur.invalidate();
+            filterValue = 0;
+        }
+
+        if (!value)
+            return [name = name, shown = image.clone()]() { cv::imshow(name, shown); };
+
+        assert(image.data);
+        const auto done = incremental ? boxBlur.update(image, value, region, blurred, stopToken) : boxBlur.apply(image, value, blurred, stopToken);
+
+        filterValue = done ? value : 0;
+        if (!done)
+            return {};
+
+        return [name = name, shown = blurred.clone()]() { cv::imshow(name, shown); };
     }
 
 public:
     using UniPtr = std::unique_ptr<ImageWindow>;
-    ImageWindow(std::string windowName, cv::Mat windowImage, int flags) : name(std::move(windowName)), image(std::move(windowImage))
+    ImageWindow(std::string windowName, cv::Mat windowImage, JobRunner &jobRunner, ResultCache &resultCache, int flags, int histogramSampling = 1, bool clahe = false, int previewSide = 0) : name(std::move(windowName)), jobs(jobRunner), results(resultCache), image(std::move(windowImage)), histogramStride(std::max(1, histogramSampling)), adaptiveEqualizer(clahe), proxy(previewSide)
     {
+        proxy.build(image);
+        if (results.enabled())
+            sourceHash = ResultCache::imageHash(image);
+
         cv::namedWindow(name, flags);
 
         cv::createTrackbar(name, name, nullptr, count, onTrackbar, this);
@@ -187,6 +316,8 @@ public:
 
     ~ImageWindow()
     {
+        jobs.cancel(this);
+
         if (!getName().empty())
             cv::destroyWindow(name);
     }
@@ -206,24 +337,28 @@ public:
         if (!value)
             return;
 
-        filterValue = value;
-
-        cv::Mat imgBlur;
-        assert(image.data);
-        cv::blur(image, imgBlur, cv::Size(value, value));
+        {
+            std::lock_guard lock{requestMutex};
+            requestedValue = value;
+        }
 
-        cv::imshow(name, imgBlur);
+        requestRender();
     }
 
-
-    void show() const
+    void annotate(cv::Point point)
     {
-        cv::imshow(name, image);
+        {
+            std::lock_guard lock{requestMutex};
+            clicks.push_back(point);
+        }
+
+        requestRender();
     }
 
-    void show(cv::Mat &img)
+    // Only before the first callback, afterwards the jobs own the image.
+    void show() const
     {
-        cv::imshow(name, img);
+        cv::imshow(name, image);
     }
 
     void move(int x, int y) const
@@ -232,11 +367,117 @@ public:
     }
 };
 
+// PGM/PPM files are streamed tile by tile on both ends; other formats are decoded or encoded whole, the
+// tiles then only bound the memory of the effects themselves.
+static int processTiled(const std::filesystem::path &input, const std::filesystem::path &output, const std::string &effects, size_t budget, int tile)
+{
+    // Creating the output sizes it before the input is read, which would destroy an input streamed from the same file.
+    std::error_code error;
+    if (std::filesystem::equivalent(input, output, error))
+    {
+        std::cerr << "Output " << output << " must not be the input image\n";
+        return -1;
+    }
+
+    PnmFile source;
+    cv::Mat image;
+    cv::Size size;
+    int type;
+
+    if (PnmFile::isPnm(input) && source.openRead(input))
+    {
+        size = source.getSize();
+        type = source.getType();
+    }
+    else
+    {
+        image = cv::imread(input);
+        size = image.size();
+        type = image.type();
+    }
+
+    if (size.empty())
+    {
+        std::cerr << input << " image dismissing!\n";
+        return -1;
+    }
+
+    Lomography lomography;
+    lomography.prepare(size);
+
+    std::vector<TileKernel> chain;
+    if (!parseEffects(effects, lomography, chain) || (type != CV_8UC3 && std::ranges::any_of(chain, [](const auto &kernel) { return kernel.name == "lomo"; })))
+    {
+        std::cerr << "Unknown or unsupported effect chain: " << effects << '\n';
+        return -1;
+    }
+
+    const TiledProcessor processor{chain, budget, tile};
+    if (const auto minimum = processor.minimumBudget(size, type); budget < minimum)
+    {
+        std::cerr << "A budget of " << budget << " bytes cannot hold a single tile of this chain, it needs at least " << minimum << " bytes\n";
+        return -1;
+    }
+
+    TileStats stats;
+
+    if (PnmFile::isPnm(output))
+    {
+        PnmFile sink;
+        if (!sink.create(output, size, type))
+        {
+            std::cerr << "Could not create " << output << '\n';
+            return -1;
+        }
+
+        stats = image.empty() ? processor.process(source, sink) : processor.process(image, sink);
+        if (image.empty() && !source.good())
+        {
+            std::cerr << "Could not read " << input << '\n';
+            return -1;
+        }
+
+        if (!sink.good())
+        {
+            std::cerr << "Could not write " << output << '\n';
+            return -1;
+        }
+    }
+    else
+    {
+        if (image.empty())
+            image = cv::imread(input);
+
+        cv::Mat result;
+        stats = processor.process(image, result);
+        if (!cv::imwrite(output, result))
+        {
+            std::cerr << "Could not write " << output << '\n';
+            return -1;
+        }
+    }
+
+    stats.print(std::cout);
+    TRACE_DUMP("lab7.trace.json");
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     const char *keys = {
             "{help h usage? || print  this message}"
-            "{@files | <none> | Image file list }"};
+            "{@files | <none> | Image file list }"
+            "{sample | 1 | Histogram sampling: count every Nth pixel of every Nth row}"
+            "{clahe | | Equalize with tiled CLAHE instead of the global histogram}"
+            "{preview | 0 | Show edits and effects on a pyramid level at most this many pixels across before the full resolution result, 0 disables}"
+            "{pool | 256 | Keep up to this many MB of released image buffers for reuse, 0 disables}"
+            "{results | | Directory of the persistent result cache, disabled when empty}"
+            "{resultcap | 2048 | Size cap of the result cache in MB}"
+            "{tiled | | Apply the effects tile by tile and write the result to this file, without a window}"
+            "{effects | lomo | Tiled effect chain, e.g. blur:15,sobel,lomo}"
+            "{budget | 512 | Memory budget of the tile buffers in MB}"
+            "{tile | 1024 | Preferred tile size in pixels}"};
 
     cv::CommandLineParser parser{argc, argv, keys};
 
@@ -251,8 +492,17 @@ int main(int argc, char **argv)
         parser.printErrors();
         return 0;
     }
-    const std::filesystem::path filePath(argv[1]);
+    const std::filesystem::path filePath(parser.get<cv::String>(0));
     std::cout << filePath << std::endl;
+
+    if (parser.has("tiled"))
+        return processTiled(filePath, parser.get<std::string>("tiled"), parser.get<std::string>("effects"),
+                            static_cast<size_t>(std::max(1, parser.get<int>("budget"))) << 20, parser.get<int>("tile"));
+
+    // The tiled path reuses its own per-worker buffers, the window effects allocate theirs on every click.
+    const auto poolBudget = static_cast<size_t>(std::max(0, parser.get<int>("pool"))) << 20;
+    const auto *pool = poolBudget ? &PoolAllocator::install(poolBudget) : nullptr;
+
     auto image = cv::imread(filePath);
     if (!image.data)
     {
@@ -260,11 +510,23 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    ImageWindow window{filePath.filename(), image, cv::WINDOW_AUTOSIZE};
+    ResultCache results{parser.get<std::string>("results"), static_cast<size_t>(std::max(0, parser.get<int>("resultcap"))) << 20};
+    JobRunner jobs;
+    ImageWindow window{filePath.filename(), image, jobs, results, cv::WINDOW_AUTOSIZE, parser.get<int>("sample"), parser.has("clahe"), parser.get<int>("preview")};
 
     window.show();
 
-    cv::waitKey(0);
+    // The callbacks only queue jobs, their results are shown from here.
+    while (cv::waitKey(10) < 0)
+        jobs.deliver();
+
+    jobs.getStats().print(std::cout);
+    if (pool)
+        pool->getStats().print(std::cout);
+    if (results.enabled())
+        results.getStats().print(std::cout);
+
+    TRACE_DUMP("lab7.trace.json");
 
     return 0;
 }
@@ -0,0 +1,20 @@
+# Writes the short revision of the source tree to OUTPUT as the OPENCVLABS_REVISION macro. Runs at
+# build time, and the header is only rewritten when the revision changed, so kernel_bench is rebuilt
+# exactly when it would report a different one.
+execute_process(COMMAND git rev-parse --short HEAD
+        WORKING_DIRECTORY ${SOURCE_DIR}
+        OUTPUT_VARIABLE revision
+        OUTPUT_STRIP_TRAILING_WHITESPACE
+        ERROR_QUIET)
+
+if (NOT revision)
+    set(revision unknown)
+endif ()
+
+set(content "#pragma once\n\n#define OPENCVLABS_REVISION \"${revision}\"\n")
+if (EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} previous)
+endif ()
+if (NOT content STREQUAL previous)
+    file(WRITE ${OUTPUT} "${content}")
+endif ()
@@ -0,0 +1,248 @@
+#include "Bench.hpp"
+#include "Cartoonizer.hpp"
+#include "Equalizer.hpp"
+#include "FilterGraph.hpp"
+#include "Histogram.hpp"
+#include "IntegralBlur.hpp"
+#include "LiveHistogram.hpp"
+#include "Lomography.hpp"
+#include "Revision.hpp"
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+// One case per kernel exposed by labs 4, 5 and 7. Each case gets a prepared synthetic image and
+// returns the callable that is timed; state built outside the callable (tables, masks, caches) is
+// the warm state the labs keep between interactions.
+struct KernelCase
+{
+    std::string name;
+    std::function<std::function<void()>(const cv::Mat &)> prepare;
+};
+
+static cv::Mat syntheticImage(cv::Size size)
+{
+    cv::Mat image{size, CV_8UC3};
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+
+    // Smooth large-scale structure on top of the noise so equalisation and edges have work to do.
+    cv::Mat ramp{size, CV_8UC3};
+    for (int y = 0; y < size.height; ++y)
+        ramp.row(y).setTo(cv::Scalar(64 + 128 * y / size.height, 96, 192 - 128 * y / size.height));
+    cv::addWeighted(image, 0.25, ramp, 0.75, 0, image);
+
+    return image;
+}
+
+static std::vector<KernelCase> kernelCases()
+{
+    std::vector<KernelCase> cases;
+
+    for (const auto ksize: {5, 25, 100})
+    {
+        cases.push_back({"blur/box k=" + std::to_string(ksize), [ksize](const cv::Mat &image)
+                         {
+                             return std::function<void()>{[&image, ksize, out = cv::Mat()]() mutable { cv::blur(image, out, cv::Size(ksize, ksize)); }};
+                         }});
+        cases.push_back({"blur/integral k=" + std::to_string(ksize), [ksize](const cv::Mat &image)
+                         {
+                             auto blur = std::make_shared<IntegralBlur>(100);
+                             blur->rebuild(image);
+                             return std::function<void()>{[&image, ksize, blur, out = cv::Mat()]() mutable { blur->apply(image, ksize, out); }};
+                         }});
+    }
+
+    cases.push_back({"blur/integral build", [](const cv::Mat &image)
+                     {
+                         auto blur = std::make_shared<IntegralBlur>(100);
+                         return std::function<void()>{[&image, blur]() { blur->rebuild(image); }};
+                     }});
+
+    cases.push_back({"chain/blur+grey+sobel cold", [](const cv::Mat &image)
+                     {
+                         return std::function<void()>{[&image]()
+                                                      {
+                                                          FilterGraph graph{image};
+                                                          graph.setEnabled(FiltersType::Blur, true);
+                                                          graph.setEnabled(FiltersType::Grey, true);
+                                                          graph.setEnabled(FiltersType::Sobel, true);
+                                                          graph.evaluate();
+                                                      }};
+                     }});
+
+    // The fused chains against the one-pass-per-filter graph above; both have to produce the same bytes.
+    for (const auto grey: {true, false})
+    {
+        const std::string stages = grey ? "blur+grey+sobel" : "blur+sobel";
+        if (!grey)
+            cases.push_back({"chain/" + stages + " cold", [](const cv::Mat &image)
+                             {
+                                 return std::function<void()>{[&image]()
+                                                              {
+                                                                  FilterGraph graph{image};
+                                                                  graph.setEnabled(FiltersType::Blur, true);
+                                                                  graph.setEnabled(FiltersType::Sobel, true);
+                                                                  graph.evaluate();
+                                                              }};
+                             }});
+
+        cases.push_back({"chain/fused " + stages, [grey](const cv::Mat &image)
+                         {
+                             FilterGraph graph{image};
+                             graph.setEnabled(FiltersType::Blur, true);
+                             graph.setEnabled(FiltersType::Grey, grey);
+                             graph.setEnabled(FiltersType::Sobel, true);
+
+                             cv::Mat fused;
+                             applyFusedChain(true, grey, true, image, fused);
+                             CV_Assert(cv::norm(graph.evaluate(), fused, cv::NORM_INF) == 0);
+
+                             return std::function<void()>{[&image, grey, out = cv::Mat()]() mutable { applyFusedChain(true, grey, true, image, out); }};
+                         }});
+    }
+
+    cases.push_back({"chain/toggle sobel", [](const cv::Mat &image)
+                     {
+                         auto graph = std::make_shared<FilterGraph>(image);
+                         graph->setEnabled(FiltersType::Blur, true);
+                         graph->setEnabled(FiltersType::Grey, true);
+                         graph->evaluate();
+                         return std::function<void()>{[graph]()
+                                                      {
+                                                          graph->toggle(FiltersType::Sobel);
+                                                          graph->evaluate();
+                                                      }};
+                     }});
+
+    for (const auto stride: {1, 4})
+        cases.push_back({"histogram/stride " + std::to_string(stride), [stride](const cv::Mat &image)
+                         {
+                             return std::function<void()>{[&image, stride, canvas = cv::Mat()]() mutable { renderHistograms(computeHistograms(image, stride), canvas); }};
+                         }});
+
+    cases.push_back({"equalize/global", [](const cv::Mat &image)
+                     {
+                         return std::function<void()>{[&image, out = cv::Mat()]() mutable { equalizeLuminance(image, out); }};
+                     }});
+
+    cases.push_back({"equalize/clahe", [](const cv::Mat &image)
+                     {
+                         return std::function<void()>{[&image, out = cv::Mat()]() mutable { equalizeLuminanceClahe(image, out); }};
+                     }});
+
+    for (const auto precision: {MaskPrecision::Fixed8, MaskPrecision::Fixed16})
+        cases.push_back({precision == MaskPrecision::Fixed8 ? "lomo/q8" : "lomo/q16", [precision](const cv::Mat &image)
+                         {
+                             auto lomography = std::make_shared<Lomography>(precision);
+                             cv::Mat warmup;
+                             lomography->apply(image, warmup);
+                             return std::function<void()>{[&image, lomography, out = cv::Mat()]() mutable { lomography->apply(image, out); }};
+                         }});
+
+    cases.push_back({"cartoon", [](const cv::Mat &image)
+                     {
+                         auto cartoonizer = std::make_shared<Cartoonizer>();
+                         return std::function<void()>{[&image, cartoonizer, out = cv::Mat()]() mutable { cartoonizer->apply(image, out); }};
+                     }});
+
+    // The lab 3 live stages as one frame of the stream costs them; at 60 fps both together get 16.7 ms.
+    cases.push_back({"live/equalize", [](const cv::Mat &image)
+                     {
+                         auto equalizer = std::make_shared<TemporalEqualizer>();
+                         return std::function<void()>{[&image, equalizer, out = cv::Mat()]() mutable { equalizer->apply(image, out); }};
+                     }});
+
+    cases.push_back({"live/histogram", [](const cv::Mat &image)
+                     {
+                         auto overlay = std::make_shared<HistogramOverlay>();
+                         return std::function<void()>{[&image, overlay, out = cv::Mat()]() mutable { overlay->apply(image, out); }};
+                     }});
+
+    cases.push_back({"live/equalize+histogram", [](const cv::Mat &image)
+                     {
+                         auto equalizer = std::make_shared<TemporalEqualizer>();
+                         auto overlay = std::make_shared<HistogramOverlay>();
+                         return std::function<void()>{[&image, equalizer, overlay, equalized = cv::Mat(), out = cv::Mat()]() mutable
+                                                      {
+                                                          equalizer->apply(image, equalized);
+                                                          overlay->apply(equalized, out);
+                                                      }};
+                     }});
+
+    return cases;
+}
+
+int main(int argc, char **argv)
+{
+    const char *keys = {
+            "{help h usage? || print  this message}"
+            "{filter | | Only run cases whose name contains this text}"
+            "{iterations | 20 | Timed iterations per case}"
+            "{sizes | 640x480,1920x1080,4000x3000 | Comma separated synthetic image sizes}"
+            "{json | | Also write the results as JSON to this file}"};
+
+    cv::CommandLineParser parser{argc, argv, keys};
+
+    if (parser.has("help"))
+    {
+        parser.printMessage();
+        return 0;
+    }
+
+    if (!parser.check())
+    {
+        parser.printErrors();
+        return 0;
+    }
+
+    const auto filter = parser.get<std::string>("filter");
+    const auto iterations = std::max(1, parser.get<int>("iterations"));
+
+    std::vector<cv::Size> sizes;
+    std::stringstream sizeList{parser.get<std::string>("sizes")};
+    for (std::string item; std::getline(sizeList, item, ',');)
+    {
+        int width = 0, height = 0;
+        char separator = 0;
+        std::stringstream{item} >> width >> separator >> height;
+        if (width > 0 && height > 0)
+            sizes.emplace_back(width, height);
+    }
+
+    benchAllocator();
+    std::vector<BenchResult> results;
+
+    for (const auto size: sizes)
+    {
+        const auto image = syntheticImage(size);
+        const auto suffix = ' ' + std::to_string(size.width) + 'x' + std::to_string(size.height);
+
+        for (const auto &kernelCase: kernelCases())
+        {
+            if (!filter.empty() && kernelCase.name.find(filter) == std::string::npos)
+                continue;
+
+            auto kernel = kernelCase.prepare(image);
+            kernel();
+
+            auto result = measure(kernelCase.name + suffix, iterations, kernel);
+            result.size = size;
+            printResult(result);
+            results.push_back(result);
+        }
+    }
+
+    const auto jsonPath = parser.get<std::string>("json");
+    if (!jsonPath.empty())
+    {
+        std::ofstream json{jsonPath};
+        writeJson(json, results, OPENCVLABS_REVISION);
+    }
+    else
+        writeJson(std::cout, results, OPENCVLABS_REVISION);
+
+    return 0;
+}
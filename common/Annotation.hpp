@@ -0,0 +1,18 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+// Draws the marker the labs put where the image is clicked and returns the rectangle of pixels it may
+// have changed, so that only that part of a filtered copy has to be redone.
+inline cv::Rect drawAnnotation(cv::Mat &image, cv::Point center)
+{
+    static const int radius = 10;
+    static const int thickness = 3;
+
+    cv::circle(image, center, radius, cv::Scalar(0, 255, 0), thickness);
+
+    const auto reach = radius + thickness;
+
+    return cv::Rect{center.x - reach, center.y - reach, 2 * reach + 1, 2 * reach + 1} & cv::Rect{{0, 0}, image.size()};
+}
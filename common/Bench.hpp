@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+// Forwards to the standard Mat allocator and keeps track of how many bytes of pixel data are alive.
+class CountingAllocator : public cv::MatAllocator
+{
+    const cv::MatAllocator *inner = cv::Mat::getStdAllocator();
+    mutable std::atomic<size_t> liveBytes{0};
+    mutable std::atomic<size_t> peakBytes{0};
+    mutable std::atomic<size_t> allocations{0};
+
+public:
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override
+    {
+        auto u = inner->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        if (!u)
+            return u;
+
+        u->currAllocator = this;
+        if (data)
+            return u;
+
+        allocations++;
+        const auto live = liveBytes += u->size;
+        auto peak = peakBytes.load();
+        while (live > peak && !peakBytes.compare_exchange_weak(peak, live)) {}
+
+        return u;
+    }
+
+    bool allocate(cv::UMatData *data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override
+    {
+        return inner->allocate(data, accessFlags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData *data) const override
+    {
+        if (!data)
+            return;
+
+        if (!(data->flags & cv::UMatData::USER_ALLOCATED))
+            liveBytes -= data->size;
+
+        data->currAllocator = inner;
+        inner->deallocate(data);
+    }
+
+    void resetPeak()
+    {
+        peakBytes = liveBytes.load();
+        allocations = 0;
+    }
+
+    [[nodiscard]] size_t getLiveBytes() const
+    {
+        return liveBytes;
+    }
+
+    [[nodiscard]] size_t getPeakBytes() const
+    {
+        return peakBytes;
+    }
+
+    [[nodiscard]] size_t getAllocations() const
+    {
+        return allocations;
+    }
+};
+
+struct BenchResult
+{
+    std::string name;
+    double medianMs = 0;
+    double p99Ms = 0;
+    size_t peakBytes = 0;
+    size_t allocations = 0;
+    int iterations = 0;
+    cv::Size size;
+
+    [[nodiscard]] double megapixelsPerSecond() const
+    {
+        return medianMs > 0 ? static_cast<double>(size.area()) / 1e3 / medianMs : 0;
+    }
+};
+
+inline CountingAllocator &benchAllocator()
+{
+    static CountingAllocator allocator;
+    [[maybe_unused]] static bool installed = []()
+    {
+        cv::Mat::setDefaultAllocator(&allocator);
+        return true;
+    }();
+
+    return allocator;
+}
+
+// Peak bytes and allocations are reported per iteration, on top of whatever was alive before the run.
+template<typename F>
+BenchResult measure(std::string name, int iterations, F &&kernel)
+{
+    auto &allocator = benchAllocator();
+    std::vector<double> samples;
+    samples.reserve(iterations);
+
+    BenchResult result{std::move(name)};
+    result.iterations = iterations;
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        const auto baseline = allocator.getLiveBytes();
+        allocator.resetPeak();
+
+        const auto start = std::chrono::steady_clock::now();
+        kernel();
+        const auto stop = std::chrono::steady_clock::now();
+
+        samples.push_back(std::chrono::duration<double, std::milli>(stop - start).count());
+        result.peakBytes = std::max(result.peakBytes, allocator.getPeakBytes() - baseline);
+        result.allocations = std::max(result.allocations, allocator.getAllocations());
+    }
+
+    std::sort(samples.begin(), samples.end());
+    result.medianMs = samples[samples.size() / 2];
+    result.p99Ms = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+
+    return result;
+}
+
+inline void printResult(const BenchResult &result)
+{
+    std::cout << std::left << std::setw(32) << result.name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << result.medianMs << " ms"
+              << std::setw(10) << result.p99Ms << " ms p99"
+              << std::setw(10) << static_cast<double>(result.peakBytes) / (1 << 20) << " MB peak"
+              << std::setw(6) << result.allocations << " allocs\n";
+}
+
+inline std::string jsonEscape(const std::string &text)
+{
+    std::string escaped;
+    for (const auto c: text)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+
+    return escaped;
+}
+
+inline void writeJson(std::ostream &out, const std::vector<BenchResult> &results, const std::string &revision)
+{
+    out << "{\n  \"revision\": \"" << jsonEscape(revision) << "\",\n  \"threads\": " << cv::getNumThreads() << ",\n  \"results\": [";
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const auto &result = results[i];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << jsonEscape(result.name) << '"'
+            << ", \"width\": " << result.size.width << ", \"height\": " << result.size.height
+            << ", \"iterations\": " << result.iterations
+            << ", \"median_ms\": " << result.medianMs << ", \"p99_ms\": " << result.p99Ms
+            << ", \"mpix_per_s\": " << result.megapixelsPerSecond()
+            << ", \"peak_bytes\": " << result.peakBytes << ", \"allocations\": " << result.allocations << '}';
+    }
+
+    out << "\n  ]\n}\n";
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <vector>
+
+struct ChangeStats
+{
+    uint64_t frames = 0;
+    uint64_t skipped = 0;
+    uint64_t partial = 0;
+    double dirtyFractionTotal = 0;
+    double detectMsTotal = 0;
+
+    [[nodiscard]] double skipRate() const
+    {
+        return frames ? static_cast<double>(skipped) / static_cast<double>(frames) : 0;
+    }
+
+    // processMsPerFrame is what a processed frame costs downstream; skipped frames save that much each,
+    // minus what detection costs on every frame.
+    void print(std::ostream &out, double processMsPerFrame) const
+    {
+        const auto processed = frames - skipped;
+        const auto savedMs = static_cast<double>(skipped) * processMsPerFrame - detectMsTotal;
+        const auto fullMs = static_cast<double>(frames) * processMsPerFrame;
+
+        out << "change detection: " << frames << " frames, " << skipped << " skipped (" << 100. * skipRate() << "%), "
+            << partial << " forwarded as dirty blocks, " << (processed ? 100. * dirtyFractionTotal / static_cast<double>(processed) : 0)
+            << "% of blocks dirty on average, detect ms avg " << (frames ? detectMsTotal / static_cast<double>(frames) : 0) << '\n'
+            << "CPU saved: " << savedMs << " ms of " << fullMs << " ms (" << (fullMs > 0 ? 100. * savedMs / fullMs : 0)
+            << "%) at " << processMsPerFrame << " ms per processed frame\n";
+    }
+};
+
+// Decides whether a video frame differs enough from the last processed one to be worth processing.
+// Both are reduced to a grey grid with one cell of cellSide x cellSide pixels per block, which averages
+// sensor noise out before they are compared; the mean absolute difference over a block, in grey levels,
+// makes the block dirty when it exceeds the threshold. A frame without dirty blocks is skipped, and only
+// dirty blocks replace the reference, so slow drift still adds up to a change. The dirty blocks come
+// back as rectangles, merged along block rows and then across rows with the same span.
+class ChangeDetector
+{
+    static constexpr int cellSide = 16;
+    // Past this share of dirty blocks a single full frame beats many small regions.
+    static constexpr double partialLimit = 0.5;
+
+    int blockSize;
+    double threshold;
+    cv::Size frameSize;
+    cv::Size grid;
+    cv::Mat reduced;
+    cv::Mat grey;
+    cv::Mat reference;
+    cv::Mat difference;
+    cv::Mat blockDifference;
+    std::vector<cv::Rect> dirty;
+    ChangeStats stats;
+
+    // Returns the share of dirty blocks.
+    double collectDirty()
+    {
+        dirty.clear();
+        int dirtyBlocks = 0;
+
+        // Runs in block units; a run continues a rectangle of the row above when their spans match.
+        std::vector<cv::Rect> open;
+        std::vector<cv::Rect> next;
+        const auto close = [&](const std::vector<cv::Rect> &rects)
+        {
+            for (const auto &rect: rects)
+                dirty.push_back(cv::Rect{rect.x * blockSize, rect.y * blockSize, rect.width * blockSize, rect.height * blockSize} & cv::Rect{{0, 0}, frameSize});
+        };
+
+        for (int y = 0; y < grid.height; ++y)
+        {
+            const auto *row = blockDifference.ptr<float>(y);
+            next.clear();
+
+            for (int x = 0; x < grid.width; ++x)
+            {
+                if (row[x] <= threshold)
+                    continue;
+
+                auto end = x;
+                while (end < grid.width && row[end] > threshold)
+                    ++end;
+
+                dirtyBlocks += end - x;
+                const auto above = std::ranges::find_if(open, [&](const cv::Rect &rect) { return rect.x == x && rect.width == end - x; });
+                if (above != open.end())
+                {
+                    next.push_back({x, above->y, end - x, above->height + 1});
+                    open.erase(above);
+                }
+                else
+                {
+                    next.push_back({x, y, end - x, 1});
+                }
+
+                x = end;
+            }
+
+            close(open);
+            open.swap(next);
+        }
+
+        close(open);
+
+        return static_cast<double>(dirtyBlocks) / static_cast<double>(grid.area());
+    }
+
+public:
+    explicit ChangeDetector(int blockSide = 64, double meanThreshold = 4) : blockSize(std::max(cellSide, blockSide)), threshold(meanThreshold)
+    {
+    }
+
+    ChangeDetector(ChangeDetector &&detector) = delete;
+    ChangeDetector &operator=(ChangeDetector &&detector) = delete;
+    ChangeDetector(ChangeDetector const &detector) = delete;
+    ChangeDetector &operator=(ChangeDetector const &detector) = delete;
+
+    // True when frame should be processed; getDirty() then lists what changed. The first frame and
+    // frames of a new size are dirty everywhere.
+    bool detect(const cv::Mat &frame)
+    {
+        TRACE_SCOPE("ChangeDetector::detect");
+        const auto start = std::chrono::steady_clock::now();
+        stats.frames++;
+
+        if (frame.empty())
+        {
+            stats.skipped++;
+            return false;
+        }
+
+        const auto reset = frame.size() != frameSize;
+        if (reset)
+        {
+            frameSize = frame.size();
+            grid = {(frameSize.width + blockSize - 1) / blockSize, (frameSize.height + blockSize - 1) / blockSize};
+        }
+
+        cv::resize(frame, reduced, {grid.width * cellSide, grid.height * cellSide}, 0, 0, cv::INTER_AREA);
+        if (reduced.channels() == 3)
+            cv::cvtColor(reduced, grey, cv::COLOR_BGR2GRAY);
+        else
+            reduced.copyTo(grey);
+
+        auto changed = true;
+        auto dirtyFraction = 1.;
+        if (reset)
+        {
+            dirty.assign(1, cv::Rect{{0, 0}, frameSize});
+        }
+        else
+        {
+            cv::absdiff(grey, reference, difference);
+            cv::resize(difference, blockDifference, grid, 0, 0, cv::INTER_AREA);
+            blockDifference.convertTo(blockDifference, CV_32F);
+
+            dirtyFraction = collectDirty();
+            changed = !dirty.empty();
+            if (dirtyFraction > partialLimit)
+                dirty.assign(1, cv::Rect{{0, 0}, frameSize});
+            else if (changed)
+                stats.partial++;
+        }
+
+        // Downstream only receives the dirty blocks of a partial change, the others stay as they were.
+        if (changed && dirty.front().size() == frameSize)
+        {
+            std::swap(reference, grey);
+        }
+        else if (changed)
+        {
+            for (const auto &rect: dirty)
+            {
+                const cv::Rect cells{rect.x / blockSize * cellSide, rect.y / blockSize * cellSide, (rect.width + blockSize - 1) / blockSize * cellSide,
+                                     (rect.height + blockSize - 1) / blockSize * cellSide};
+                grey(cells).copyTo(reference(cells));
+            }
+        }
+
+        if (changed)
+            stats.dirtyFractionTotal += dirtyFraction;
+        else
+            stats.skipped++;
+
+        stats.detectMsTotal += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        return changed;
+    }
+
+    // Regions of the last frame detect() passed, in frame coordinates; a single full-frame rectangle
+    // when most of it changed.
+    [[nodiscard]] const std::vector<cv::Rect> &getDirty() const
+    {
+        return dirty;
+    }
+
+    [[nodiscard]] const ChangeStats &getStats() const
+    {
+        return stats;
+    }
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+struct ChannelHistograms
+{
+    std::array<std::array<uint32_t, 256>, 3> bins{};
+    uint64_t samples = 0;
+};
+
+// Draws each channel as a single polyline, min-max normalised to the canvas height like the
+// cv::normalize(NORM_MINMAX) version did. The canvas is reused when it already has the right size.
+inline void renderHistograms(const ChannelHistograms &histograms, cv::Mat &canvas, int width = 512, int height = 300)
+{
+    TRACE_SCOPE("renderHistograms");
+
+    canvas.create(height, width, CV_8UC3);
+    canvas.setTo(cv::Scalar(20, 20, 20));
+
+    const std::array<cv::Scalar, 3> colours = {cv::Scalar(255, 0, 0), cv::Scalar(0, 255, 0), cv::Scalar(0, 0, 255)};
+    const auto bins = static_cast<int>(histograms.bins[0].size());
+    const auto binWidth = cvRound(static_cast<float>(width) / static_cast<float>(bins));
+    std::array<cv::Point, 256> points;
+
+    for (size_t channel = 0; channel < histograms.bins.size(); ++channel)
+    {
+        const auto &histogram = histograms.bins[channel];
+        const auto [low, high] = std::minmax_element(histogram.begin(), histogram.end());
+        const auto range = static_cast<double>(*high - *low);
+        const auto scale = range > 0 ? height / range : 0.;
+
+        for (int i = 0; i < bins; ++i)
+            points[i] = cv::Point(binWidth * i, height - cvRound((histogram[i] - *low) * scale));
+
+        const auto *data = points.data();
+        cv::polylines(canvas, &data, &bins, 1, false, colours[channel], 2, cv::LINE_8);
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// 64-bit content hash that consumes eight bytes per step. Not cryptographic, only meant to tell
+// files and pixel buffers apart as fast as memory can be read.
+inline uint64_t contentHash(const void *data, size_t size, uint64_t seed = 0)
+{
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    auto hash = seed ^ (size * multiplier);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ (word * multiplier)) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 29;
+    }
+
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    hash = (hash ^ (tail * multiplier)) * 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 32;
+
+    return hash;
+}
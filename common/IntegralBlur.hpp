@@ -0,0 +1,235 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stop_token>
+#include <vector>
+
+// Normalized box blur answered from a per-channel summed-area table. The table is built once per
+// image with the cv::blur default border (reflect 101) baked in for every kernel up to maxKernel,
+// after which any kernel size costs four lookups per pixel and channel. Sums are kept modulo 2^32,
+// which stays exact for box sums while letting the table grow past the int range on large images.
+// apply() and update() check an optional stop token once per row and give up early when it fires, except
+// while building the table of the whole image: it serves every kernel size, so the job that replaces a
+// stopped one, typically the next kernel size of a drag, finds it ready instead of starting over.
+class IntegralBlur
+{
+    int maxKernel;
+    int padding;
+    cv::Mat table;
+    cv::Mat patchTable;
+    cv::Mat patch;
+    const uchar *imageData = nullptr;
+    cv::Size imageSize;
+    int imageType = -1;
+    bool dirty = true;
+
+    template<int cn>
+    void build(const cv::Mat &image, cv::Mat &integral, const std::stop_token &stopToken) const
+    {
+        const auto rows = image.rows + 2 * padding;
+        const auto cols = image.cols + 2 * padding;
+
+        std::vector<int> columnMap(cols);
+        for (int x = 0; x < cols; ++x)
+            columnMap[x] = cv::borderInterpolate(x - padding, image.cols, cv::BORDER_REFLECT_101) * cn;
+
+        integral.create(rows + 1, cols + 1, CV_32SC(cn));
+        std::fill_n(integral.ptr<uint32_t>(0), (cols + 1) * cn, 0u);
+
+        cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range)
+                          {
+                              for (int y = range.start; y < range.end && !stopToken.stop_requested(); ++y)
+                              {
+                                  const auto *in = image.ptr<uchar>(cv::borderInterpolate(y - padding, image.rows, cv::BORDER_REFLECT_101));
+                                  auto *out = integral.ptr<uint32_t>(y + 1);
+                                  uint32_t sums[cn] = {};
+
+                                  for (int c = 0; c < cn; ++c)
+                                      out[c] = 0;
+
+                                  for (int x = 0; x < cols; ++x)
+                                  {
+                                      out += cn;
+                                      for (int c = 0; c < cn; ++c)
+                                          out[c] = sums[c] += in[columnMap[x] + c];
+                                  }
+                              }
+                          });
+
+        const auto width = (cols + 1) * cn;
+        cv::parallel_for_(cv::Range(0, width), [&](const cv::Range &range)
+                          {
+                              for (int y = 2; y <= rows && !stopToken.stop_requested(); ++y)
+                              {
+                                  const auto *above = integral.ptr<uint32_t>(y - 1);
+                                  auto *current = integral.ptr<uint32_t>(y);
+                                  for (int x = range.start; x < range.end; ++x)
+                                      current[x] += above[x];
+                              }
+                          });
+    }
+
+    template<int cn>
+    void query(const cv::Mat &integral, int ksize, cv::Mat &dst, const std::stop_token &stopToken) const
+    {
+        const auto inverseArea = 1.f / static_cast<float>(ksize * ksize);
+        const auto anchor = ksize / 2;
+
+        cv::parallel_for_(cv::Range(0, dst.rows), [&](const cv::Range &range)
+                          {
+                              for (int y = range.start; y < range.end && !stopToken.stop_requested(); ++y)
+                              {
+                                  const auto top = y - anchor + padding;
+                                  const auto *upper = integral.ptr<uint32_t>(top);
+                                  const auto *lower = integral.ptr<uint32_t>(top + ksize);
+                                  auto *out = dst.ptr<uchar>(y);
+
+                                  for (int x = 0; x < dst.cols; ++x, out += cn)
+                                  {
+                                      const auto left = (x - anchor + padding) * cn;
+                                      const auto right = left + ksize * cn;
+                                      for (int c = 0; c < cn; ++c)
+                                      {
+                                          const auto sum = lower[right + c] - lower[left + c] - upper[right + c] + upper[left + c];
+                                          out[c] = cv::saturate_cast<uchar>(static_cast<float>(sum) * inverseArea);
+                                      }
+                                  }
+                              }
+                          });
+    }
+
+    void build(const cv::Mat &image, cv::Mat &integral, const std::stop_token &stopToken = {}) const
+    {
+        switch (image.type())
+        {
+            case CV_8UC1:
+                build<1>(image, integral, stopToken);
+                break;
+            case CV_8UC3:
+                build<3>(image, integral, stopToken);
+                break;
+            case CV_8UC4:
+                build<4>(image, integral, stopToken);
+                break;
+            default:
+                CV_Error(cv::Error::StsBadArg, "IntegralBlur supports 8-bit images with 1, 3 or 4 channels");
+        }
+    }
+
+    void query(const cv::Mat &integral, int ksize, cv::Mat &dst, const std::stop_token &stopToken = {}) const
+    {
+        switch (dst.channels())
+        {
+            case 1:
+                query<1>(integral, ksize, dst, stopToken);
+                break;
+            case 3:
+                query<3>(integral, ksize, dst, stopToken);
+                break;
+            case 4:
+                query<4>(integral, ksize, dst, stopToken);
+                break;
+        }
+    }
+
+    [[nodiscard]] bool fallsBack(const cv::Mat &image, int ksize) const
+    {
+        return ksize > maxKernel || image.rows <= padding || image.cols <= padding;
+    }
+
+public:
+    explicit IntegralBlur(int maxKernelSize = 100) : maxKernel(maxKernelSize), padding(maxKernelSize / 2)
+    {
+    }
+
+    // Call after the source pixels were modified in place.
+    void invalidate()
+    {
+        dirty = true;
+    }
+
+    void rebuild(const cv::Mat &image)
+    {
+        TRACE_SCOPE("IntegralBlur::rebuild");
+
+        build(image, table);
+
+        imageData = image.data;
+        imageSize = image.size();
+        imageType = image.type();
+        dirty = false;
+    }
+
+    // Returns false when stopped before dst was complete.
+    bool apply(const cv::Mat &image, int ksize, cv::Mat &dst, const std::stop_token &stopToken = {})
+    {
+        TRACE_SCOPE("IntegralBlur::apply");
+        CV_Assert(ksize > 0);
+
+        if (fallsBack(image, ksize))
+        {
+            cv::blur(image, dst, cv::Size(ksize, ksize));
+            return true;
+        }
+
+        if (dirty || image.data != imageData || image.size() != imageSize || image.type() != imageType)
+            rebuild(image);
+
+        if (stopToken.stop_requested())
+            return false;
+
+        if (dst.data == image.data)
+            dst.release();
+        dst.create(image.size(), image.type());
+
+        query(table, ksize, dst, stopToken);
+
+        return !stopToken.stop_requested();
+    }
+
+    // Brings dst, the result of apply() before image was modified inside changed, up to date by
+    // re-blurring only the pixels whose box overlaps the change. They are computed from a table over
+    // the change plus two kernel radii; box sums are exact, so the pixels match a full apply(). The
+    // full table goes stale and is rebuilt by the next apply().
+    bool update(const cv::Mat &image, int ksize, cv::Rect changed, cv::Mat &dst, const std::stop_token &stopToken = {})
+    {
+        TRACE_SCOPE("IntegralBlur::update");
+        CV_Assert(ksize > 0 && dst.size() == image.size() && dst.type() == image.type());
+
+        dirty = true;
+
+        const auto radius = ksize / 2;
+        const cv::Rect bounds{{0, 0}, image.size()};
+        const auto grow = [&](cv::Rect rect) { return cv::Rect{rect.x - radius, rect.y - radius, rect.width + 2 * radius, rect.height + 2 * radius} & bounds; };
+
+        const auto affected = grow(changed);
+        if (affected.empty())
+            return true;
+
+        // Where the neighbourhood meets the image edge, its reflected border is the image's; elsewhere it
+        // reaches a radius past every box of the affected pixels, so its border is never read for them.
+        const auto neighbourhood = grow(affected);
+        const auto source = image(neighbourhood);
+        if (fallsBack(image, ksize))
+        {
+            cv::blur(source, patch, cv::Size(ksize, ksize));
+        }
+        else
+        {
+            build(source, patchTable, stopToken);
+            patch.create(source.size(), source.type());
+            query(patchTable, ksize, patch, stopToken);
+        }
+
+        if (stopToken.stop_requested())
+            return false;
+
+        patch(cv::Rect{affected.tl() - neighbourhood.tl(), affected.size()}).copyTo(dst(affected));
+
+        return true;
+    }
+};
@@ -0,0 +1,319 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Latencies of a session of any length in a fixed amount of memory: a uniform sample of at most
+// capacity values (reservoir sampling) for the percentiles, and the exact maximum.
+struct LatencySamples
+{
+    static constexpr size_t capacity = 4096;
+
+    std::vector<double> samples;
+    uint64_t seen = 0;
+    double max = 0;
+    std::minstd_rand random;
+
+    void add(double ms)
+    {
+        max = std::max(max, ms);
+        if (samples.size() < capacity)
+            samples.push_back(ms);
+        else if (const auto slot = std::uniform_int_distribution<uint64_t>{0, seen}(random); slot < capacity)
+            samples[slot] = ms;
+
+        seen++;
+    }
+};
+
+struct JobStats
+{
+    uint64_t submitted = 0;
+    uint64_t coalesced = 0;
+    uint64_t cancelled = 0;
+    uint64_t completed = 0;
+    uint64_t superseded = 0;
+    uint64_t delivered = 0;
+    uint64_t previews = 0;
+    LatencySamples latencyMs;
+    LatencySamples previewLatencyMs;
+
+    [[nodiscard]] static double percentile(std::vector<double> samples, double fraction)
+    {
+        if (samples.empty())
+            return 0;
+
+        std::sort(samples.begin(), samples.end());
+        return samples[std::min(samples.size() - 1, static_cast<size_t>(fraction * static_cast<double>(samples.size())))];
+    }
+
+    // coalesced jobs were replaced before they started, cancelled ones were stopped while running and
+    // superseded results were replaced by a newer one before the GUI thread showed them.
+    void print(std::ostream &out) const
+    {
+        const auto latency = [&](const char *label, const LatencySamples &latencies)
+        {
+            out << label << " ms p50 " << percentile(latencies.samples, 0.5) << " p90 " << percentile(latencies.samples, 0.9)
+                << " p99 " << percentile(latencies.samples, 0.99) << " max " << latencies.max;
+        };
+
+        out << "jobs: " << submitted << " submitted, " << coalesced << " coalesced, " << cancelled << " cancelled, "
+            << completed << " completed, " << superseded << " superseded, " << delivered << " shown; ";
+        latency("input to display", latencyMs);
+        out << '\n';
+
+        if (previews)
+        {
+            out << "previews: " << previews << " shown; ";
+            latency("input to preview", previewLatencyMs);
+            out << '\n';
+        }
+    }
+};
+
+// Runs window callbacks as jobs on a small worker pool so HighGUI stays responsive while they compute.
+// Jobs are submitted under an owner (a window) and a key (what they update, e.g. its view). Jobs of
+// one owner never run concurrently, so they can use the owner's state without locks. A new job
+// replaces the pending job with the same key, and asks a running one to stop through its stop token:
+// the latest request wins. A job returns what to show, or nothing when it stopped early; HighGUI may
+// only be called from the main thread, so results are posted and shown by deliver(), newest per key.
+// A job may come with a quick preview job, which runs first and whose result is shown in the meantime.
+class JobRunner
+{
+public:
+    using Present = std::function<void()>;
+    using Job = std::function<Present(const std::stop_token &stopToken)>;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Pending
+    {
+        std::string key;
+        Job job;
+        Job preview;
+        Clock::time_point submitted;
+    };
+
+    struct Owner
+    {
+        std::deque<Pending> pending;
+        bool queued = false;
+        bool running = false;
+        std::string runningKey;
+        std::stop_source stopSource;
+    };
+
+    struct Result
+    {
+        Present present;
+        Clock::time_point submitted;
+        bool preview = false;
+    };
+
+    std::mutex mutex;
+    std::condition_variable_any ready;
+    std::condition_variable idle;
+    std::map<const void *, Owner> owners;
+    std::deque<const void *> queue;
+    std::map<std::pair<const void *, std::string>, Result> results;
+    JobStats stats;
+    std::vector<std::jthread> workers;
+
+    void enqueue(const void *owner, Owner &state)
+    {
+        if (state.queued || state.running || state.pending.empty())
+            return;
+
+        state.queued = true;
+        queue.push_back(owner);
+        ready.notify_one();
+    }
+
+    void post(const void *owner, const std::string &key, Present present, Clock::time_point submitted, bool preview)
+    {
+        auto &result = results[{owner, key}];
+        if (result.present)
+            stats.superseded++;
+        result = {std::move(present), submitted, preview};
+    }
+
+    void workerLoop(const std::stop_token &stopToken)
+    {
+        std::unique_lock lock{mutex};
+
+        while (ready.wait(lock, stopToken, [&]() { return !queue.empty(); }))
+        {
+            const auto *owner = queue.front();
+            queue.pop_front();
+
+            auto &state = owners[owner];
+            auto pending = std::move(state.pending.front());
+            state.pending.pop_front();
+            state.queued = false;
+            state.running = true;
+            state.runningKey = pending.key;
+            state.stopSource = {};
+            const auto jobToken = state.stopSource.get_token();
+
+            lock.unlock();
+            if (pending.preview)
+            {
+                Present preview;
+                {
+                    TRACE_SCOPE("JobRunner::preview");
+                    preview = pending.preview(jobToken);
+                }
+
+                if (preview && !jobToken.stop_requested())
+                {
+                    std::lock_guard previewLock{mutex};
+                    post(owner, pending.key, std::move(preview), pending.submitted, true);
+                }
+            }
+
+            Present present;
+            if (!jobToken.stop_requested())
+            {
+                TRACE_SCOPE("JobRunner::job");
+                present = pending.job(jobToken);
+            }
+            lock.lock();
+
+            state.running = false;
+            if (!present || jobToken.stop_requested())
+            {
+                stats.cancelled++;
+            }
+            else
+            {
+                stats.completed++;
+                post(owner, pending.key, std::move(present), pending.submitted, false);
+            }
+
+            enqueue(owner, state);
+            idle.notify_all();
+        }
+    }
+
+public:
+    explicit JobRunner(unsigned threads = 0)
+    {
+        if (!threads)
+            threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+
+        for (unsigned i = 0; i < threads; ++i)
+            workers.emplace_back([this](const std::stop_token &stopToken) { workerLoop(stopToken); });
+    }
+
+    ~JobRunner()
+    {
+        {
+            std::lock_guard lock{mutex};
+            for (auto &[owner, state]: owners)
+                state.stopSource.request_stop();
+        }
+
+        workers.clear();
+    }
+
+    JobRunner(JobRunner &&runner) = delete;
+    JobRunner &operator=(JobRunner &&runner) = delete;
+    JobRunner(JobRunner const &runner) = delete;
+    JobRunner &operator=(JobRunner const &runner) = delete;
+
+    void submit(const void *owner, const std::string &key, Job job, Job preview = {})
+    {
+        std::lock_guard lock{mutex};
+        stats.submitted++;
+
+        auto &state = owners[owner];
+        if (state.running && state.runningKey == key)
+            state.stopSource.request_stop();
+
+        const auto replaced = std::ranges::find(state.pending, key, &Pending::key);
+        if (replaced != state.pending.end())
+        {
+            stats.coalesced++;
+            *replaced = {key, std::move(job), std::move(preview), Clock::now()};
+        }
+        else
+        {
+            state.pending.push_back({key, std::move(job), std::move(preview), Clock::now()});
+        }
+
+        enqueue(owner, state);
+    }
+
+    // Drops the pending jobs and results of owner and waits for its running job to stop. Call before
+    // the state the jobs use goes away.
+    void cancel(const void *owner)
+    {
+        std::unique_lock lock{mutex};
+        const auto found = owners.find(owner);
+        if (found == owners.end())
+            return;
+
+        auto &state = found->second;
+        stats.coalesced += state.pending.size();
+        state.pending.clear();
+        state.stopSource.request_stop();
+        idle.wait(lock, [&]() { return !state.running; });
+
+        std::erase_if(queue, [&](const void *queued) { return queued == owner; });
+        std::erase_if(results, [&](const auto &result) { return result.first.first == owner; });
+        owners.erase(found);
+    }
+
+    // Shows the results finished since the last call. Call from the thread that owns the windows.
+    size_t deliver()
+    {
+        decltype(results) finished;
+        {
+            std::lock_guard lock{mutex};
+            finished.swap(results);
+        }
+
+        for (auto &[key, result]: finished)
+        {
+            result.present();
+
+            const auto latencyMs = std::chrono::duration<double, std::milli>(Clock::now() - result.submitted).count();
+            std::lock_guard lock{mutex};
+            if (result.preview)
+            {
+                stats.previews++;
+                stats.previewLatencyMs.add(latencyMs);
+            }
+            else
+            {
+                stats.delivered++;
+                stats.latencyMs.add(latencyMs);
+            }
+        }
+
+        return finished.size();
+    }
+
+    [[nodiscard]] JobStats getStats()
+    {
+        std::lock_guard lock{mutex};
+
+        return stats;
+    }
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+using LuminanceLut = std::array<uchar, 256>;
+
+// Y of BGR->YCrCb with the same 14-bit fixed-point coefficients cv::cvtColor uses.
+inline int luminance(const uchar *bgr)
+{
+    return (bgr[0] * 1868 + bgr[1] * 9617 + bgr[2] * 4899 + (1 << 13)) >> 14;
+}
+
+// The YCrCb round trip leaves chroma untouched, so converting back after changing Y only shifts every
+// channel by the change in Y. Applying that shift directly gives the same image up to rounding.
+inline void shiftLuminance(const uchar *in, uchar *out, int newY, int oldY)
+{
+    const auto delta = newY - oldY;
+    out[0] = cv::saturate_cast<uchar>(in[0] + delta);
+    out[1] = cv::saturate_cast<uchar>(in[1] + delta);
+    out[2] = cv::saturate_cast<uchar>(in[2] + delta);
+}
+
+// Same mapping as cv::equalizeHist.
+inline LuminanceLut equalizationLut(const std::array<uint32_t, 256> &histogram)
+{
+    LuminanceLut lut{};
+
+    int first = 0;
+    while (first < 255 && !histogram[first])
+        ++first;
+
+    uint64_t total = 0;
+    for (const auto count: histogram)
+        total += count;
+
+    if (histogram[first] == total)
+    {
+        lut.fill(static_cast<uchar>(first));
+        return lut;
+    }
+
+    const auto scale = 255.f / static_cast<float>(total - histogram[first]);
+    uint64_t sum = 0;
+
+    for (int bin = first + 1; bin < 256; ++bin)
+    {
+        sum += histogram[bin];
+        lut[bin] = cv::saturate_cast<uchar>(static_cast<float>(sum) * scale);
+    }
+
+    return lut;
+}
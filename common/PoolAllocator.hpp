@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <vector>
+
+struct PoolStats
+{
+    size_t liveBytes = 0;
+    size_t idleBytes = 0;
+    size_t peakBytes = 0;
+    uint64_t requests = 0;
+    uint64_t reused = 0;
+    uint64_t systemAllocations = 0;
+
+    [[nodiscard]] double reuseRate() const
+    {
+        return requests ? static_cast<double>(reused) / static_cast<double>(requests) : 0;
+    }
+
+    void print(std::ostream &out) const
+    {
+        out << "buffer pool: " << requests << " requests, " << reused << " reused (" << 100. * reuseRate() << "%), "
+            << systemAllocations << " from the system, live " << (liveBytes >> 20) << " MB, idle " << (idleBytes >> 20)
+            << " MB, peak " << (peakBytes >> 20) << " MB\n";
+    }
+};
+
+// Mat allocator that recycles pixel buffers instead of returning them to the system, so effects that
+// allocate the same full-size temporaries on every call stop paying for fresh pages each time.
+// Buffers are rounded up to size classes an eighth of a power of two apart, at most 12.5% waste,
+// and a released buffer waits in its class until a request of that class takes it again. Idle buffers
+// are held up to a budget, beyond it released ones go back to the system. Small buffers are left to
+// the system allocator, which already serves those from its own free lists.
+class PoolAllocator : public cv::MatAllocator
+{
+    static constexpr size_t minPooledBytes = 64 << 10;
+    // CV_AUTOSTEP of the C API, which the C++ headers do not declare.
+    static constexpr size_t autoStep = 0x7fffffff;
+
+    size_t budget;
+    mutable std::mutex mutex;
+    mutable std::map<size_t, std::vector<void *>> idle;
+    mutable PoolStats stats;
+
+    static size_t sizeClass(size_t bytes)
+    {
+        const auto step = std::max<size_t>(std::bit_floor(bytes) / 8, 4096);
+        return (bytes + step - 1) / step * step;
+    }
+
+    void *take(size_t bytes) const
+    {
+        std::lock_guard lock{mutex};
+        stats.requests++;
+        stats.liveBytes += bytes;
+
+        void *data = nullptr;
+        auto found = idle.find(bytes);
+        if (found != idle.end() && !found->second.empty())
+        {
+            data = found->second.back();
+            found->second.pop_back();
+            stats.idleBytes -= bytes;
+            stats.reused++;
+        }
+        else
+        {
+            stats.systemAllocations++;
+        }
+
+        stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes + stats.idleBytes);
+        return data;
+    }
+
+    bool give(void *data, size_t bytes) const
+    {
+        std::lock_guard lock{mutex};
+        stats.liveBytes -= bytes;
+        if (stats.idleBytes + bytes > budget)
+            return false;
+
+        idle[bytes].push_back(data);
+        stats.idleBytes += bytes;
+        return true;
+    }
+
+public:
+    explicit PoolAllocator(size_t budgetBytes) : budget(budgetBytes)
+    {
+    }
+
+    ~PoolAllocator() override
+    {
+        trim();
+    }
+
+    PoolAllocator(PoolAllocator &&allocator) = delete;
+    PoolAllocator &operator=(PoolAllocator &&allocator) = delete;
+    PoolAllocator(PoolAllocator const &allocator) = delete;
+    PoolAllocator &operator=(PoolAllocator const &allocator) = delete;
+
+    // Makes a pool the default Mat allocator for the rest of the process. It is never destroyed, as Mats
+    // in static storage may still give their buffers back after main returns.
+    static PoolAllocator &install(size_t budgetBytes)
+    {
+        static auto *pool = new PoolAllocator(budgetBytes);
+        cv::Mat::setDefaultAllocator(pool);
+
+        return *pool;
+    }
+
+    // Same layout as the standard allocator: dense rows, pixel data from cv::fastMalloc.
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, [[maybe_unused]] cv::AccessFlag flags, [[maybe_unused]] cv::UMatUsageFlags usageFlags) const override
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; --i)
+        {
+            if (step)
+            {
+                if (data && step[i] != autoStep)
+                {
+                    CV_Assert(total <= step[i]);
+                    total = step[i];
+                }
+                else
+                {
+                    step[i] = total;
+                }
+            }
+
+            total *= sizes[i];
+        }
+
+        auto *u = new cv::UMatData(this);
+        if (data)
+        {
+            u->data = u->origdata = static_cast<uchar *>(data);
+            u->size = total;
+            u->flags |= cv::UMatData::USER_ALLOCATED;
+            return u;
+        }
+
+        // size keeps the class, so the buffer goes back to the class it came from.
+        const auto bytes = total < minPooledBytes ? total : sizeClass(total);
+        auto *buffer = total < minPooledBytes ? nullptr : take(bytes);
+        if (!buffer)
+            buffer = cv::fastMalloc(bytes);
+
+        u->data = u->origdata = static_cast<uchar *>(buffer);
+        u->size = bytes;
+        return u;
+    }
+
+    bool allocate(cv::UMatData *data, [[maybe_unused]] cv::AccessFlag accessFlags, [[maybe_unused]] cv::UMatUsageFlags usageFlags) const override
+    {
+        return data != nullptr;
+    }
+
+    void deallocate(cv::UMatData *data) const override
+    {
+        if (!data)
+            return;
+
+        CV_Assert(data->urefcount == 0 && data->refcount == 0);
+        if (!(data->flags & cv::UMatData::USER_ALLOCATED) && (data->size < minPooledBytes || !give(data->origdata, data->size)))
+            cv::fastFree(data->origdata);
+
+        delete data;
+    }
+
+    // Returns every idle buffer to the system.
+    void trim()
+    {
+        std::lock_guard lock{mutex};
+        for (auto &[bytes, buffers]: idle)
+            for (auto *buffer: buffers)
+                cv::fastFree(buffer);
+
+        idle.clear();
+        stats.idleBytes = 0;
+    }
+
+    [[nodiscard]] PoolStats getStats() const
+    {
+        std::lock_guard lock{mutex};
+
+        return stats;
+    }
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <vector>
+
+// A reduced copy of an image for interactive previews: the first level of its Gaussian pyramid whose
+// longer side fits in maxSide. Edits of the image are carried down the pyramid over the changed
+// rectangle only. Each level is reduced from a region with enough margin, aligned to even coordinates,
+// that pyrDown reads the same pixels as on the whole image, so the proxy always equals a fresh build.
+class PreviewProxy
+{
+    int maxSide;
+    std::vector<cv::Mat> levels;
+    cv::Mat scratch;
+    cv::Size imageSize;
+
+    // Returns the part of dst that changed.
+    cv::Rect reduce(const cv::Mat &src, cv::Mat &dst, cv::Rect changed)
+    {
+        // An output pixel reads the source two pixels either side of twice its position.
+        const auto left = std::max(0, (changed.x - 2) / 2);
+        const auto top = std::max(0, (changed.y - 2) / 2);
+        const auto right = std::min(dst.cols, (changed.x + changed.width + 2) / 2 + 1);
+        const auto bottom = std::min(dst.rows, (changed.y + changed.height + 2) / 2 + 1);
+        const cv::Rect affected{left, top, right - left, bottom - top};
+
+        const auto sourceLeft = std::max(0, 2 * left - 4);
+        const auto sourceTop = std::max(0, 2 * top - 4);
+        const cv::Rect source{sourceLeft, sourceTop, std::min(src.cols, 2 * right + 4) - sourceLeft, std::min(src.rows, 2 * bottom + 4) - sourceTop};
+
+        cv::pyrDown(src(source), scratch);
+        scratch(cv::Rect{left - sourceLeft / 2, top - sourceTop / 2, affected.width, affected.height}).copyTo(dst(affected));
+
+        return affected;
+    }
+
+public:
+    // maxPreviewSide 0 disables the proxy.
+    explicit PreviewProxy(int maxPreviewSide = 0) : maxSide(maxPreviewSide)
+    {
+    }
+
+    // False when disabled or when the image already fits, a preview would then cost as much as the result.
+    [[nodiscard]] bool enabled() const
+    {
+        return !levels.empty();
+    }
+
+    void build(const cv::Mat &image)
+    {
+        TRACE_SCOPE("PreviewProxy::build");
+        levels.clear();
+        imageSize = image.size();
+
+        if (maxSide <= 0)
+            return;
+
+        const auto *current = &image;
+        while (std::max(current->cols, current->rows) > maxSide)
+        {
+            levels.emplace_back();
+            cv::pyrDown(*current, levels.back());
+            current = &levels.back();
+        }
+    }
+
+    // Call after the image was modified inside changed.
+    void update(const cv::Mat &image, cv::Rect changed)
+    {
+        TRACE_SCOPE("PreviewProxy::update");
+        if (image.size() != imageSize)
+        {
+            build(image);
+            return;
+        }
+
+        changed &= cv::Rect{{0, 0}, image.size()};
+        const auto *current = &image;
+        for (auto &level: levels)
+        {
+            if (changed.empty())
+                break;
+
+            changed = reduce(*current, level, changed);
+            current = &level;
+        }
+    }
+
+    [[nodiscard]] const cv::Mat &get() const
+    {
+        return levels.back();
+    }
+
+    // A kernel of ksize full-resolution pixels measured on the proxy.
+    [[nodiscard]] int scaleKernel(int ksize) const
+    {
+        return std::max(1, cvRound(ksize * static_cast<double>(get().cols) / imageSize.width));
+    }
+
+    // Brings a result computed on the proxy back to the image size, so the window does not resize.
+    void upscale(const cv::Mat &preview, cv::Mat &dst) const
+    {
+        TRACE_SCOPE("PreviewProxy::upscale");
+        cv::resize(preview, dst, imageSize, 0, 0, cv::INTER_LINEAR);
+    }
+};
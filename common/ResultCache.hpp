@@ -0,0 +1,368 @@
+#pragma once
+
+#include "ContentHash.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct ResultCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t stores = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+
+    void print(std::ostream &out) const
+    {
+        out << "result cache: " << hits << " hits, " << misses << " misses, " << stores << " stores, " << evictions
+            << " evictions, " << entries << " entries, " << (bytes >> 20) << " MB on disk\n";
+    }
+};
+
+// Owns a file mapping behind a Mat, the mapping goes away with the last Mat referencing it.
+class MappedFileAllocator : public cv::MatAllocator
+{
+public:
+    // Never destroyed, mapped Mats may outlive main.
+    static const MappedFileAllocator &instance()
+    {
+        static const auto *allocator = new MappedFileAllocator;
+        return *allocator;
+    }
+
+    cv::UMatData *allocate([[maybe_unused]] int dims, [[maybe_unused]] const int *sizes, [[maybe_unused]] int type, [[maybe_unused]] void *data,
+                           [[maybe_unused]] size_t *step, [[maybe_unused]] cv::AccessFlag flags, [[maybe_unused]] cv::UMatUsageFlags usageFlags) const override
+    {
+        CV_Error(cv::Error::StsNotImplemented, "MappedFileAllocator only wraps existing mappings");
+    }
+
+    bool allocate(cv::UMatData *data, [[maybe_unused]] cv::AccessFlag accessFlags, [[maybe_unused]] cv::UMatUsageFlags usageFlags) const override
+    {
+        return data != nullptr;
+    }
+
+    void deallocate(cv::UMatData *data) const override
+    {
+        if (!data)
+            return;
+
+        munmap(data->origdata, data->size);
+        delete data;
+    }
+
+    // A Mat of the given layout over the mapping, taking ownership of it.
+    cv::Mat wrap(void *mapping, size_t length, size_t offset, int rows, int cols, int type) const
+    {
+        cv::Mat mat(rows, cols, type, static_cast<uchar *>(mapping) + offset);
+
+        auto *u = new cv::UMatData(this);
+        u->data = u->origdata = static_cast<uchar *>(mapping);
+        u->size = length;
+        u->refcount = 1;
+        mat.u = u;
+        mat.allocator = const_cast<MappedFileAllocator *>(this);
+
+        return mat;
+    }
+};
+
+// Effect results kept on disk between runs, keyed by a hash of the source pixels and of a description
+// of the operation and its parameters. An entry is a 64 byte header followed by the raw rows, so a hit
+// is one mmap of the file with no decode; the pages are copy on write and never reach the file. The
+// total size is held under a cap by deleting the least recently used entries; recency survives
+// restarts as the file modification time, which every hit refreshes. Entries are written to a
+// temporary name and renamed, so a crash never leaves a torn entry behind.
+class ResultCache
+{
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        int32_t rows;
+        int32_t cols;
+        int32_t type;
+        uint64_t key;
+        uint64_t rowBytes;
+        char padding[24];
+    };
+
+    static_assert(sizeof(Header) == 64);
+    static constexpr char magic[8] = {'O', 'C', 'V', 'L', 'R', 'E', 'S', '\0'};
+    static constexpr uint32_t version = 1;
+
+    struct Entry
+    {
+        size_t bytes;
+        std::list<uint64_t>::iterator recent;
+    };
+
+    std::filesystem::path directory;
+    size_t cap;
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::list<uint64_t> recentlyUsed;
+    ResultCacheStats stats;
+
+    [[nodiscard]] std::filesystem::path entryPath(uint64_t key) const
+    {
+        std::ostringstream name;
+        name << std::hex << std::setw(16) << std::setfill('0') << key << ".res";
+
+        return directory / name.str();
+    }
+
+    // Picks up the entries earlier runs left, oldest first.
+    void scan()
+    {
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::directory_entry>> found;
+        std::error_code error;
+
+        for (const auto &entry: std::filesystem::directory_iterator(directory, error))
+        {
+            if (entry.path().extension() == ".tmp")
+                std::filesystem::remove(entry.path(), error);
+            else if (entry.is_regular_file() && entry.path().extension() == ".res")
+                found.emplace_back(entry.last_write_time(error), entry);
+        }
+
+        std::sort(found.begin(), found.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+        for (const auto &[time, entry]: found)
+        {
+            const auto stem = entry.path().stem().string();
+            char *end = nullptr;
+            const auto key = std::strtoull(stem.c_str(), &end, 16);
+            if (stem.size() != 16 || *end)
+                continue;
+
+            recentlyUsed.push_front(key);
+            entries.emplace(key, Entry{entry.file_size(error), recentlyUsed.begin()});
+            stats.bytes += entries.at(key).bytes;
+        }
+
+        stats.entries = entries.size();
+        evictOverCap(0);
+    }
+
+    void evictOverCap(size_t incoming)
+    {
+        while (!recentlyUsed.empty() && stats.bytes + incoming > cap)
+        {
+            const auto key = recentlyUsed.back();
+            recentlyUsed.pop_back();
+
+            auto found = entries.find(key);
+            stats.bytes -= found->second.bytes;
+            entries.erase(found);
+
+            std::error_code error;
+            std::filesystem::remove(entryPath(key), error);
+            stats.evictions++;
+        }
+
+        stats.entries = entries.size();
+    }
+
+    void forget(uint64_t key)
+    {
+        auto found = entries.find(key);
+        if (found == entries.end())
+            return;
+
+        stats.bytes -= found->second.bytes;
+        recentlyUsed.erase(found->second.recent);
+        entries.erase(found);
+        stats.entries = entries.size();
+    }
+
+public:
+    // An empty directory disables the cache.
+    ResultCache(std::filesystem::path cacheDirectory, size_t capBytes) : directory(std::move(cacheDirectory)), cap(capBytes)
+    {
+        if (directory.empty())
+            return;
+
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        if (error)
+        {
+            std::cerr << "Result cache disabled, cannot create " << directory << ": " << error.message() << '\n';
+            directory.clear();
+            return;
+        }
+
+        scan();
+    }
+
+    ResultCache(ResultCache &&cache) = delete;
+    ResultCache &operator=(ResultCache &&cache) = delete;
+    ResultCache(ResultCache const &cache) = delete;
+    ResultCache &operator=(ResultCache const &cache) = delete;
+
+    [[nodiscard]] bool enabled() const
+    {
+        return !directory.empty();
+    }
+
+    // Hash of the pixels, size and type of a source image.
+    static uint64_t imageHash(const cv::Mat &image)
+    {
+        TRACE_SCOPE("ResultCache::imageHash");
+        const int shape[3] = {image.rows, image.cols, image.type()};
+        auto hash = contentHash(shape, sizeof(shape));
+
+        const auto rowBytes = image.cols * image.elemSize();
+        if (image.isContinuous())
+            return contentHash(image.data, rowBytes * image.rows, hash);
+
+        for (int y = 0; y < image.rows; ++y)
+            hash = contentHash(image.ptr(y), rowBytes, hash);
+
+        return hash;
+    }
+
+    // operation names the effect and every parameter that changes its output, e.g. "lomo q16".
+    static uint64_t key(uint64_t imageHash, const std::string &operation)
+    {
+        return contentHash(operation.data(), operation.size(), imageHash);
+    }
+
+    bool load(uint64_t key, cv::Mat &result)
+    {
+        if (!enabled())
+            return false;
+
+        TRACE_SCOPE("ResultCache::load");
+        {
+            std::lock_guard lock{mutex};
+            const auto found = entries.find(key);
+            if (found == entries.end())
+            {
+                stats.misses++;
+                return false;
+            }
+
+            recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, found->second.recent);
+        }
+
+        const auto path = entryPath(key);
+        const auto file = open(path.c_str(), O_RDONLY);
+        struct stat info{};
+        void *mapping = MAP_FAILED;
+
+        if (file >= 0 && fstat(file, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(Header))
+            mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+        if (file >= 0)
+            close(file);
+
+        Header header{};
+        if (mapping != MAP_FAILED)
+            std::memcpy(&header, mapping, sizeof(header));
+
+        const auto length = static_cast<size_t>(info.st_size);
+        const auto valid = mapping != MAP_FAILED && std::equal(std::begin(magic), std::end(magic), header.magic) && header.version == version &&
+                           header.key == key && header.rows > 0 && header.cols > 0 &&
+                           header.rowBytes == header.cols * static_cast<uint64_t>(CV_ELEM_SIZE(header.type)) &&
+                           length == sizeof(Header) + header.rowBytes * header.rows;
+
+        std::lock_guard lock{mutex};
+        if (!valid)
+        {
+            if (mapping != MAP_FAILED)
+                munmap(mapping, length);
+
+            forget(key);
+            std::error_code error;
+            std::filesystem::remove(path, error);
+            stats.misses++;
+            return false;
+        }
+
+        std::error_code error;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+        result = MappedFileAllocator::instance().wrap(mapping, length, sizeof(Header), header.rows, header.cols, header.type);
+        stats.hits++;
+
+        return true;
+    }
+
+    void store(uint64_t key, const cv::Mat &result)
+    {
+        if (!enabled() || result.empty() || result.dims != 2)
+            return;
+
+        TRACE_SCOPE("ResultCache::store");
+        Header header{};
+        std::copy(std::begin(magic), std::end(magic), header.magic);
+        header.version = version;
+        header.rows = result.rows;
+        header.cols = result.cols;
+        header.type = result.type();
+        header.key = key;
+        header.rowBytes = result.cols * result.elemSize();
+
+        const auto bytes = sizeof(Header) + header.rowBytes * header.rows;
+        if (bytes > cap)
+            return;
+
+        const auto path = entryPath(key);
+        auto temporary = path;
+        temporary += ".tmp";
+
+        {
+            std::ofstream file{temporary, std::ios::binary};
+            file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            for (int y = 0; y < result.rows && file; ++y)
+                file.write(reinterpret_cast<const char *>(result.ptr(y)), static_cast<std::streamsize>(header.rowBytes));
+
+            if (!file)
+            {
+                std::error_code error;
+                std::filesystem::remove(temporary, error);
+                return;
+            }
+        }
+
+        std::lock_guard lock{mutex};
+        forget(key);
+        evictOverCap(bytes);
+
+        std::error_code error;
+        std::filesystem::rename(temporary, path, error);
+        if (error)
+            return;
+
+        recentlyUsed.push_front(key);
+        entries.emplace(key, Entry{bytes, recentlyUsed.begin()});
+        stats.bytes += bytes;
+        stats.entries = entries.size();
+        stats.stores++;
+    }
+
+    [[nodiscard]] ResultCacheStats getStats() const
+    {
+        std::lock_guard lock{mutex};
+        return stats;
+    }
+};
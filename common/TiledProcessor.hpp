@@ -0,0 +1,414 @@
+#pragma once
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// One neighbourhood operation of a tiled chain. halo is the reach of the kernel in pixels: an output
+// pixel depends on input pixels at most halo away. origin is the image position of the top-left
+// input pixel, for kernels that depend on where they are (a vignette). Output keeps the input type.
+struct TileKernel
+{
+    std::string name;
+    int halo = 0;
+    std::function<void(const cv::Mat &in, cv::Point origin, cv::Mat &out)> apply;
+};
+
+inline TileKernel boxBlurKernel(int ksize)
+{
+    return {"blur", ksize / 2, [ksize](const cv::Mat &in, cv::Point, cv::Mat &out) { cv::blur(in, out, cv::Size(ksize, ksize)); }};
+}
+
+inline TileKernel sobelKernel()
+{
+    return {"sobel", 1, [](const cv::Mat &in, cv::Point, cv::Mat &out) { cv::Sobel(in, out, CV_8U, 1, 1); }};
+}
+
+// Binary 8-bit PGM (P5) or PPM (P6) file, read and written by rectangle so that an image never has to
+// be in memory as a whole. Rows are stored as BGR like a cv::Mat; the file itself holds RGB.
+class PnmFile
+{
+    std::fstream file;
+    std::mutex mutex;
+    cv::Size size;
+    int channels = 0;
+    std::streamoff dataOffset = 0;
+
+    static std::string token(std::istream &in)
+    {
+        std::string value;
+        while (in >> std::ws && in.peek() == '#')
+            in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        in >> value;
+
+        return value;
+    }
+
+    // A malformed header fails the open rather than throwing.
+    static bool number(std::istream &in, int &value)
+    {
+        const auto text = token(in);
+        const auto *end = text.data() + text.size();
+        const auto [last, error] = std::from_chars(text.data(), end, value);
+
+        return !text.empty() && error == std::errc{} && last == end;
+    }
+
+    [[nodiscard]] std::streamoff offset(int x, int y) const
+    {
+        return dataOffset + (static_cast<std::streamoff>(y) * size.width + x) * channels;
+    }
+
+public:
+    PnmFile() = default;
+
+    PnmFile(PnmFile &&file) = delete;
+    PnmFile &operator=(PnmFile &&file) = delete;
+    PnmFile(PnmFile const &file) = delete;
+    PnmFile &operator=(PnmFile const &file) = delete;
+
+    static bool isPnm(const std::filesystem::path &path)
+    {
+        auto extension = path.extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+
+        return extension == ".ppm" || extension == ".pgm" || extension == ".pnm";
+    }
+
+    bool openRead(const std::filesystem::path &path)
+    {
+        file.open(path, std::ios::in | std::ios::binary);
+        if (!file)
+            return false;
+
+        const auto magic = token(file);
+        int width = 0;
+        int height = 0;
+        int maxValue = 0;
+        if (!number(file, width) || !number(file, height) || !number(file, maxValue))
+            return false;
+        file.get();
+
+        if ((magic != "P5" && magic != "P6") || maxValue != 255 || width <= 0 || height <= 0)
+            return false;
+
+        size = {width, height};
+        channels = magic == "P6" ? 3 : 1;
+        dataOffset = file.tellg();
+        if (!file)
+            return false;
+
+        // A truncated file would otherwise only show up as short reads in the middle of a run.
+        std::error_code error;
+        const auto fileSize = std::filesystem::file_size(path, error);
+
+        return !error && fileSize >= static_cast<uintmax_t>(offset(0, size.height));
+    }
+
+    // Writes the header and sizes the file, tiles can then be written in any order.
+    bool create(const std::filesystem::path &path, cv::Size imageSize, int type)
+    {
+        CV_Assert(type == CV_8UC1 || type == CV_8UC3);
+
+        size = imageSize;
+        channels = CV_MAT_CN(type);
+
+        {
+            std::ofstream header{path, std::ios::binary | std::ios::trunc};
+            header << (channels == 3 ? "P6" : "P5") << '\n' << size.width << ' ' << size.height << "\n255\n";
+            dataOffset = header.tellp();
+            if (!header)
+                return false;
+        }
+
+        std::error_code error;
+        std::filesystem::resize_file(path, static_cast<uintmax_t>(offset(0, size.height)), error);
+        if (error)
+            return false;
+
+        file.open(path, std::ios::in | std::ios::out | std::ios::binary);
+
+        return static_cast<bool>(file);
+    }
+
+    [[nodiscard]] cv::Size getSize() const
+    {
+        return size;
+    }
+
+    [[nodiscard]] int getType() const
+    {
+        return CV_8UC(channels);
+    }
+
+    // A failed read leaves the stream failed, check good() once done.
+    void read(cv::Rect region, cv::Mat &dst)
+    {
+        TRACE_SCOPE("PnmFile::read");
+        dst.create(region.size(), getType());
+
+        std::lock_guard lock{mutex};
+        for (int y = 0; y < region.height; ++y)
+        {
+            file.seekg(offset(region.x, region.y + y));
+            file.read(dst.ptr<char>(y), static_cast<std::streamsize>(region.width) * channels);
+        }
+
+        if (channels == 3)
+            cv::cvtColor(dst, dst, cv::COLOR_RGB2BGR);
+    }
+
+    void write(cv::Rect region, const cv::Mat &tile)
+    {
+        TRACE_SCOPE("PnmFile::write");
+        CV_Assert(tile.type() == getType() && tile.size() == region.size());
+
+        cv::Mat rgb;
+        if (channels == 3)
+            cv::cvtColor(tile, rgb, cv::COLOR_BGR2RGB);
+        const auto &rows = channels == 3 ? rgb : tile;
+
+        std::lock_guard lock{mutex};
+        for (int y = 0; y < region.height; ++y)
+        {
+            file.seekp(offset(region.x, region.y + y));
+            file.write(rows.ptr<char>(y), static_cast<std::streamsize>(region.width) * channels);
+        }
+    }
+
+    [[nodiscard]] bool good() const
+    {
+        return static_cast<bool>(file);
+    }
+};
+
+struct TileStats
+{
+    size_t tiles = 0;
+    cv::Size tileSize;
+    unsigned workers = 0;
+    size_t estimatedBytes = 0;
+    size_t peakBytes = 0;
+    double elapsedMs = 0;
+
+    void print(std::ostream &out) const
+    {
+        out << "Tiled: " << tiles << " tiles of " << tileSize.width << 'x' << tileSize.height << " on " << workers << " workers, peak "
+            << (peakBytes >> 20) << " MB of tile buffers (estimated " << (estimatedBytes >> 20) << " MB), " << elapsedMs << " ms\n";
+    }
+};
+
+// Runs a chain of TileKernels over an image one tile at a time. Each tile is read with the combined
+// halo of the chain around it, and after every kernel the part that is still exact is kept; where a
+// tile touches the image edge the missing halo is filled by reflection (the cv::blur and cv::Sobel
+// default), so the output matches the chain run on the whole image bit for bit. The tile size and the
+// number of tiles in flight are chosen so that the tile buffers stay within the memory budget.
+class TiledProcessor
+{
+    // Below this side a tile is mostly halo; a budget that does not fit one is rejected instead.
+    static constexpr int minimumTile = 16;
+
+    using Reader = std::function<void(cv::Rect, cv::Mat &)>;
+    using Writer = std::function<void(cv::Rect, const cv::Mat &)>;
+
+    // Buffers a worker keeps from one tile to the next.
+    struct Workspace
+    {
+        cv::Mat input;
+        cv::Mat padded;
+        cv::Mat output;
+
+        [[nodiscard]] size_t bytes() const
+        {
+            return input.total() * input.elemSize() + padded.total() * padded.elemSize() + output.total() * output.elemSize();
+        }
+    };
+
+    std::vector<TileKernel> chain;
+    size_t budgetBytes;
+    int preferredTile;
+    unsigned threads;
+    int totalHalo = 0;
+
+    [[nodiscard]] size_t tileBytes(int tile, size_t pixelBytes) const
+    {
+        const auto side = static_cast<size_t>(tile + 2 * totalHalo);
+
+        return 3 * side * side * pixelBytes;
+    }
+
+    [[nodiscard]] static cv::Rect grow(cv::Rect tile, int halo, cv::Size imageSize)
+    {
+        const cv::Rect grown{tile.x - halo, tile.y - halo, tile.width + 2 * halo, tile.height + 2 * halo};
+
+        return grown & cv::Rect{{0, 0}, imageSize};
+    }
+
+    void processTile(cv::Rect tile, cv::Size imageSize, Workspace &workspace, const Reader &read, const Writer &write) const
+    {
+        TRACE_SCOPE("TiledProcessor::tile");
+
+        auto remaining = totalHalo;
+        auto covered = grow(tile, remaining, imageSize);
+        read(covered, workspace.input);
+        cv::Mat current = workspace.input;
+
+        for (const auto &kernel: chain)
+        {
+            remaining -= kernel.halo;
+            const auto needed = grow(tile, remaining, imageSize);
+
+            const auto top = covered.y == 0 ? kernel.halo : 0;
+            const auto left = covered.x == 0 ? kernel.halo : 0;
+            const auto bottom = covered.br().y == imageSize.height ? kernel.halo : 0;
+            const auto right = covered.br().x == imageSize.width ? kernel.halo : 0;
+            cv::copyMakeBorder(current, workspace.padded, top, bottom, left, right, cv::BORDER_REFLECT_101);
+
+            const cv::Point origin{covered.x - left, covered.y - top};
+            kernel.apply(workspace.padded, origin, workspace.output);
+            CV_Assert(workspace.output.size() == workspace.padded.size() && workspace.output.type() == workspace.padded.type());
+
+            // The next kernel reads from output, so the view has to move to a buffer that kernel does not write.
+            workspace.output(cv::Rect{needed.tl() - origin, needed.size()}).copyTo(workspace.input);
+            current = workspace.input;
+            covered = needed;
+        }
+
+        write(tile, current);
+    }
+
+    TileStats run(cv::Size imageSize, int type, const Reader &read, const Writer &write) const
+    {
+        TRACE_SCOPE("TiledProcessor::run");
+        const auto start = std::chrono::steady_clock::now();
+        const auto pixelBytes = static_cast<size_t>(CV_ELEM_SIZE(type));
+
+        // Largest square tile that fits the budget at least once, then as many workers as still fit.
+        auto tile = std::min({preferredTile, imageSize.width, imageSize.height});
+        while (tile > minimumTile && tileBytes(tile, pixelBytes) > budgetBytes)
+            tile /= 2;
+
+        if (tileBytes(tile, pixelBytes) > budgetBytes)
+            CV_Error(cv::Error::StsNoMem, "The memory budget does not fit a single tile, see TiledProcessor::minimumBudget");
+
+        const auto maxThreads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        const auto fitting = static_cast<unsigned>(budgetBytes / tileBytes(tile, pixelBytes));
+        const auto workers = std::clamp(fitting, 1u, maxThreads);
+
+        std::vector<cv::Rect> tiles;
+        for (int y = 0; y < imageSize.height; y += tile)
+            for (int x = 0; x < imageSize.width; x += tile)
+                tiles.emplace_back(cv::Rect{x, y, tile, tile} & cv::Rect{{0, 0}, imageSize});
+
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> live{0};
+        std::atomic<size_t> peak{0};
+
+        {
+            std::vector<std::jthread> pool;
+            for (unsigned i = 0; i < workers; ++i)
+                pool.emplace_back([&]()
+                                  {
+                                      Workspace workspace;
+                                      size_t held = 0;
+
+                                      for (auto index = next++; index < tiles.size(); index = next++)
+                                      {
+                                          processTile(tiles[index], imageSize, workspace, read, write);
+
+                                          const auto bytes = workspace.bytes();
+                                          const auto total = live += bytes - held;
+                                          held = bytes;
+
+                                          auto seen = peak.load();
+                                          while (total > seen && !peak.compare_exchange_weak(seen, total))
+                                              ;
+                                      }
+
+                                      live -= held;
+                                  });
+        }
+
+        TileStats stats;
+        stats.tiles = tiles.size();
+        stats.tileSize = {tile, tile};
+        stats.workers = workers;
+        stats.estimatedBytes = workers * tileBytes(tile, pixelBytes);
+        stats.peakBytes = peak;
+        stats.elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        return stats;
+    }
+
+public:
+    TiledProcessor(std::vector<TileKernel> kernels, size_t memoryBudget, int tileSize = 1024, unsigned maxThreads = 0)
+            : chain(std::move(kernels)), budgetBytes(memoryBudget), preferredTile(std::max(1, tileSize)), threads(maxThreads)
+    {
+        for (const auto &kernel: chain)
+            totalHalo += kernel.halo;
+    }
+
+    TiledProcessor(TiledProcessor &&processor) = delete;
+    TiledProcessor &operator=(TiledProcessor &&processor) = delete;
+    TiledProcessor(TiledProcessor const &processor) = delete;
+    TiledProcessor &operator=(TiledProcessor const &processor) = delete;
+
+    [[nodiscard]] int getHalo() const
+    {
+        return totalHalo;
+    }
+
+    // The smallest budget the chain can run in for an image of this size and type, with one worker.
+    [[nodiscard]] size_t minimumBudget(cv::Size imageSize, int type) const
+    {
+        auto tile = std::min({preferredTile, imageSize.width, imageSize.height});
+        while (tile > minimumTile)
+            tile /= 2;
+
+        return tileBytes(tile, static_cast<size_t>(CV_ELEM_SIZE(type)));
+    }
+
+    // Streams a PGM/PPM file into another without holding either image in memory.
+    TileStats process(PnmFile &input, PnmFile &output) const
+    {
+        const auto size = input.getSize();
+        CV_Assert(std::min(size.width, size.height) > totalHalo && output.getSize() == size && output.getType() == input.getType());
+
+        return run(size, input.getType(), [&](cv::Rect region, cv::Mat &dst) { input.read(region, dst); },
+                   [&](cv::Rect region, const cv::Mat &tile) { output.write(region, tile); });
+    }
+
+    // Decoded input, streamed output.
+    TileStats process(const cv::Mat &src, PnmFile &output) const
+    {
+        CV_Assert(std::min(src.cols, src.rows) > totalHalo && output.getSize() == src.size() && output.getType() == src.type());
+
+        return run(src.size(), src.type(), [&](cv::Rect region, cv::Mat &dst) { src(region).copyTo(dst); },
+                   [&](cv::Rect region, const cv::Mat &tile) { output.write(region, tile); });
+    }
+
+    TileStats process(const cv::Mat &src, cv::Mat &dst) const
+    {
+        CV_Assert(std::min(src.cols, src.rows) > totalHalo && src.data != dst.data);
+        dst.create(src.size(), src.type());
+
+        return run(src.size(), src.type(), [&](cv::Rect region, cv::Mat &tile) { src(region).copyTo(tile); },
+                   [&](cv::Rect region, const cv::Mat &tile) { tile.copyTo(dst(region)); });
+    }
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+// Scoped hot-path tracing. Build with -DOPENCVLABS_TRACE=ON to record; otherwise TRACE_SCOPE and
+// TRACE_DUMP expand to nothing. Every thread appends to its own fixed-size buffer with no locks;
+// TRACE_DUMP writes all buffers as a Chrome/Perfetto trace (chrome://tracing, ui.perfetto.dev) and
+// prints call counts and latency percentiles per scope. Scope names must be string literals.
+
+#ifdef OPENCVLABS_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct TraceEvent
+{
+    const char *name;
+    int64_t start;
+    int64_t duration;
+};
+
+class TraceBuffer
+{
+    std::vector<TraceEvent> events;
+    std::atomic<size_t> size{0};
+    std::atomic<size_t> dropped{0};
+
+public:
+    static const size_t capacity = 1 << 16;
+    const int threadId;
+
+    explicit TraceBuffer(int id) : events(capacity), threadId(id)
+    {
+    }
+
+    // Only the owning thread writes, the release store publishes the event to readers.
+    void push(const char *name, int64_t start, int64_t duration)
+    {
+        const auto count = size.load(std::memory_order_relaxed);
+        if (count == capacity)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        events[count] = {name, start, duration};
+        size.store(count + 1, std::memory_order_release);
+    }
+
+    template<typename F>
+    void forEach(F &&visit) const
+    {
+        const auto count = size.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; ++i)
+            visit(events[i]);
+    }
+
+    [[nodiscard]] size_t getDropped() const
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+};
+
+class Tracer
+{
+    using Clock = std::chrono::steady_clock;
+
+    const Clock::time_point origin = Clock::now();
+    std::mutex mutex;
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+
+    std::shared_ptr<TraceBuffer> registerThread()
+    {
+        std::lock_guard lock{mutex};
+        buffers.push_back(std::make_shared<TraceBuffer>(static_cast<int>(buffers.size()) + 1));
+
+        return buffers.back();
+    }
+
+    static double percentile(const std::vector<int64_t> &sorted, double fraction)
+    {
+        const auto index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * static_cast<double>(sorted.size())));
+        return static_cast<double>(sorted[index]) / 1e6;
+    }
+
+public:
+    static Tracer &instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    [[nodiscard]] int64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - origin).count();
+    }
+
+    TraceBuffer &threadBuffer()
+    {
+        thread_local auto buffer = registerThread();
+        return *buffer;
+    }
+
+    void writeChromeTrace(std::ostream &out)
+    {
+        std::lock_guard lock{mutex};
+        out << "{\"traceEvents\": [";
+
+        auto first = true;
+        out << std::fixed << std::setprecision(3);
+        for (const auto &buffer: buffers)
+            buffer->forEach([&](const TraceEvent &event)
+                            {
+                                out << (first ? "\n" : ",\n") << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->threadId
+                                    << ", \"ts\": " << static_cast<double>(event.start) / 1e3 << ", \"dur\": " << static_cast<double>(event.duration) / 1e3 << '}';
+                                first = false;
+                            });
+
+        out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    }
+
+    void writeSummary(std::ostream &out)
+    {
+        std::map<std::string, std::vector<int64_t>> durations;
+        size_t dropped = 0;
+        {
+            std::lock_guard lock{mutex};
+            for (const auto &buffer: buffers)
+            {
+                buffer->forEach([&](const TraceEvent &event) { durations[event.name].push_back(event.duration); });
+                dropped += buffer->getDropped();
+            }
+        }
+
+        out << std::left << std::setw(36) << "scope" << std::right << std::setw(8) << "calls" << std::setw(12) << "total ms"
+            << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms" << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << '\n'
+            << std::fixed << std::setprecision(3);
+
+        for (auto &[name, samples]: durations)
+        {
+            std::sort(samples.begin(), samples.end());
+            int64_t total = 0;
+            for (const auto sample: samples)
+                total += sample;
+
+            out << std::left << std::setw(36) << name << std::right << std::setw(8) << samples.size()
+                << std::setw(12) << static_cast<double>(total) / 1e6 << std::setw(10) << percentile(samples, 0.5)
+                << std::setw(10) << percentile(samples, 0.9) << std::setw(10) << percentile(samples, 0.99)
+                << std::setw(10) << static_cast<double>(samples.back()) / 1e6 << '\n';
+        }
+
+        if (dropped)
+            out << dropped << " events dropped, per-thread buffers hold " << TraceBuffer::capacity << '\n';
+    }
+
+    void dump(const std::string &path)
+    {
+        std::ofstream file{path};
+        writeChromeTrace(file);
+        writeSummary(std::cout);
+        std::cout << "Trace written to " << path << '\n';
+    }
+};
+
+class ScopedTrace
+{
+    const char *name;
+    int64_t start;
+
+public:
+    explicit ScopedTrace(const char *scopeName) : name(scopeName), start(Tracer::instance().now())
+    {
+    }
+
+    ~ScopedTrace()
+    {
+        auto &tracer = Tracer::instance();
+        const auto end = tracer.now();
+        tracer.threadBuffer().push(name, start, end - start);
+    }
+
+    ScopedTrace(ScopedTrace const &trace) = delete;
+    ScopedTrace &operator=(ScopedTrace const &trace) = delete;
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SCOPE(name) const ScopedTrace TRACE_CONCAT(traceScope, __LINE__){name}
+#define TRACE_DUMP(path) Tracer::instance().dump(path)
+
+#else
+
+#define TRACE_SCOPE(name) ((void) 0)
+#define TRACE_DUMP(path) ((void) 0)
+
+#endif